@@ -0,0 +1,96 @@
+#include "chip8.h"
+#include "rewind.h"
+#include <new>
+#include <stdlib.h>
+
+using namespace std;
+
+// checks the hot path never touches the heap: every operator new is counted, the machine
+// is warmed up, then frames, runs, save and load and rewind push and pop must not move the count
+// exits 0 if nothing was allocated, 1 if anything was
+
+static uint64_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size != 0 ? size : 1);
+    if (p == NULL)
+        throw bad_alloc();
+    return p;
+}
+
+void *operator new(size_t size, align_val_t align)
+{
+    allocations++;
+    size_t alignment = (size_t)align;
+    void *p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment + (size == 0 ? alignment : 0));
+    if (p == NULL)
+        throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new[](size_t size, align_val_t align) { return operator new(size, align); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, align_val_t) noexcept { free(p); }
+void operator delete[](void *p, align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, align_val_t) noexcept { free(p); }
+void operator delete[](void *p, size_t, align_val_t) noexcept { free(p); }
+
+// random digits drawn across the screen, BCD writes into memory near the code, a call,
+// the delay timer and fused sequences, so decoding, invalidation and drawing all happen
+static const uint8_t program[] = {
+    0xA3, 0x00, // 200 I = 300
+    0xC0, 0xFF, // 202 V0 = random
+    0xF0, 0x33, // 204 BCD of V0 at I
+    0xF2, 0x65, // 206 V0..V2 from I
+    0xF0, 0x29, // 208 I = digit V0
+    0xD1, 0x25, // 20A draw at V1, V2
+    0x22, 0x12, // 20C call 212
+    0x71, 0x01, // 20E V1 += 1
+    0x12, 0x00, // 210 jump 200
+    0xF3, 0x15, // 212 delay = V3
+    0x73, 0x02, // 214 V3 += 2
+    0x00, 0xEE, // 216 return
+};
+
+static void Work(Chip8 &chip8, Chip8State &saved, Chip8Rewind &rewind)
+{
+    for (int i = 0; i < 120; i++)
+    {
+        chip8.RunFrame();
+        rewind.Push(chip8);
+    }
+    chip8.Run(100000);
+    chip8.SaveState(saved);
+    chip8.Run(1000);
+    chip8.LoadState(saved);
+    for (int i = 0; i < 60; i++)
+        rewind.Rewind(chip8);
+}
+
+// static so they are zeroed and nothing here needs the heap
+static Chip8 machine;
+static Chip8State snapshot;
+static Chip8Rewind history;
+
+int main()
+{
+    machine.ResetCPU(program, sizeof(program));
+
+    // first passes decode the program and fill the rewind ring
+    Work(machine, snapshot, history);
+    Work(machine, snapshot, history);
+
+    uint64_t before = allocations;
+    for (int i = 0; i < 10; i++)
+        Work(machine, snapshot, history);
+    uint64_t hot = allocations - before;
+
+    printf("allocations: %llu in the hot path\n", (unsigned long long)hot);
+    return hot == 0 ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+#include "aot.h"
+#include <limits.h>
+
+// every module linked into the program, filled in before main runs
+static std::vector<const Chip8AotModule *> &Modules()
+{
+    static std::vector<const Chip8AotModule *> modules;
+    return modules;
+}
+
+void Chip8Aot::Register(const Chip8AotModule *module)
+{
+    // handlers the blocks call, decoded once with the module's profile, here while static
+    // initialisation is still single threaded so every Chip8Aot can share them read only
+    const Chip8Quirks *profile = Chip8::FindQuirks(module->quirks);
+    for (int i = 0; i < module->opCount; i++)
+    {
+        module->ops[i] = Chip8::Decode(module->opcodes[i], profile != NULL ? *profile : QUIRKS_DEFAULT);
+    }
+    Modules().push_back(module);
+}
+
+const Chip8AotModule *Chip8Aot::Find(const Chip8 &chip8)
+{
+    std::vector<const Chip8AotModule *> &modules = Modules();
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        const Chip8AotModule *m = modules[i];
+        if (strcmp(m->quirks, chip8.quirks->name) == 0 &&
+            memcmp(m->image + Chip8State::START_ADDRESS, chip8.memory + Chip8State::START_ADDRESS, m->romSize) == 0)
+            return m;
+    }
+    return NULL;
+}
+
+Chip8Aot::Chip8Aot(const Chip8AotModule &module) : module(module)
+{
+    nativeSteps = 0;
+    interpretedSteps = 0;
+    profile = Chip8::FindQuirks(module.quirks);
+
+    // where each compiled instruction is, instructions are 2 bytes apart inside a block
+    for (int i = 0; i < 4096; i++)
+    {
+        entries[i].block = -1;
+        entries[i].index = 0;
+    }
+    memset(covered, 0, sizeof(covered));
+    for (int b = 0; b < module.blockCount; b++)
+    {
+        const Chip8AotBlock &block = module.blocks[b];
+        for (int pc = block.start; pc < block.end; pc += 2)
+        {
+            entries[pc].block = b;
+            entries[pc].index = (pc - block.start) / 2;
+        }
+        memset(&covered[block.start], 1, block.end - block.start);
+    }
+    checks.assign(module.blockCount, UNCHECKED);
+}
+
+void Chip8Aot::Attach(Chip8 &chip8)
+{
+    chip8.aot = this;
+    Invalidate(0, sizeof(chip8.memory));
+}
+
+void Chip8Aot::Invalidate(uint16_t address, int length)
+{
+    if (length >= 4096)
+    {
+        checks.assign(checks.size(), UNCHECKED);
+        return;
+    }
+
+    // writes almost always land in data, only look for blocks when they hit code
+    // an instruction starting one byte before the write overlaps it too
+    bool hit = false;
+    for (int i = -1; i < length; i++)
+    {
+        hit |= covered[(address + i) & 0xFFF];
+    }
+    if (!hit)
+        return;
+
+    int first = (address - 1) & 0xFFF;
+    int last = first + length + 1; // may run past 0xFFF, writes wrap
+    for (int b = 0; b < module.blockCount; b++)
+    {
+        const Chip8AotBlock &block = module.blocks[b];
+        if ((block.start < last && block.end > first) || (last > 0x1000 && block.start < last - 0x1000))
+            checks[b] = UNCHECKED;
+    }
+}
+
+bool Chip8Aot::Usable(Chip8 &chip8, int block)
+{
+    if (checks[block] == UNCHECKED)
+    {
+        const Chip8AotBlock &b = module.blocks[block];
+        bool same = memcmp(chip8.memory + b.start, module.image + b.start, b.end - b.start) == 0;
+        checks[block] = same ? GOOD : BAD;
+    }
+    return checks[block] == GOOD;
+}
+
+void Chip8Aot::Run(Chip8 &chip8, uint64_t cycles)
+{
+    chip8.idleLoop = 0;
+    bool compiled = chip8.quirks == profile; // blocks have the module's quirks built in
+
+    uint64_t done = 0;
+    while (done < cycles)
+    {
+        uint16_t pc = chip8.programCounter;
+        const Entry &e = entries[pc & 0xFFF];
+        if (compiled && pc <= 0xFFF && e.block >= 0 && Usable(chip8, e.block))
+        {
+            uint64_t left = cycles - done;
+            int ran = module.blocks[e.block].code(chip8, e.index, left > INT_MAX ? INT_MAX : (int)left);
+            done += ran;
+            nativeSteps += ran;
+        }
+        else
+        {
+            // Cycle starts a fresh Run, keep what an earlier instruction found
+            uint8_t idle = chip8.idleLoop;
+            chip8.Cycle();
+            if (chip8.idleLoop == 0)
+                chip8.idleLoop = idle;
+            done++;
+            interpretedSteps++;
+        }
+
+        // same as Chip8::Run, skip whole passes round a loop that can't get anywhere
+        if (chip8.idleLoop != 0)
+        {
+            uint64_t left = cycles - done;
+            done += left - left % chip8.idleLoop;
+        }
+    }
+}
+
+void Chip8Aot::RunFrame(Chip8 &chip8)
+{
+    Run(chip8, chip8.instructionsPerFrame);
+    chip8.TickTimers();
+}
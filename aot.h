@@ -0,0 +1,78 @@
+#pragma once
+
+#include "chip8.h"
+
+// ahead-of-time recompiled ROMs, chip8-recompile turns a ROM into a C++ file with one function
+// per basic block, linking that file into a program registers it here at startup
+// a block only runs while memory still holds the bytes it was compiled from and the machine
+// uses the profile it was compiled for, anything else is left to the interpreter (Chip8::Cycle)
+
+// one basic block, code runs from instruction entry on and stops after budget instructions
+// or at the end of the block, whichever comes first, PC and opcode are left as the
+// interpreter would leave them and it returns how many instructions ran
+struct Chip8AotBlock
+{
+    uint16_t start; // first instruction
+    uint16_t end;   // one past last byte covered
+    int (*code)(Chip8 &, int entry, int budget);
+};
+
+// everything a generated file hands over
+struct Chip8AotModule
+{
+    const char *rom;              // file it was compiled from, for messages
+    const char *quirks;           // profile it was compiled for
+    uint16_t romSize;             // ROM bytes from START_ADDRESS, to find the module for a machine
+    const uint8_t *image;         // the 4096 bytes of memory the blocks were compiled from
+    const Chip8AotBlock *blocks;  // in address order
+    int blockCount;
+    const uint16_t *opcodes;      // instructions the blocks pass to interpreter handlers
+    Chip8::Instruction *ops;      // the same decoded under the module's profile, filled in by Register
+    int opCount;
+};
+
+class Chip8Aot
+{
+public:
+    Chip8Aot(const Chip8AotModule &module);
+
+    static void Register(const Chip8AotModule *module);   // linked in modules call this at startup, before any thread starts
+    static const Chip8AotModule *Find(const Chip8 &chip8); // module for the ROM and profile this machine has, NULL if none
+
+    void Attach(Chip8 &chip8);               // start receiving code writes from this Chip8
+    void Run(Chip8 &chip8, uint64_t cycles); // same result as chip8.Run(cycles)
+    void RunFrame(Chip8 &chip8);             // same result as chip8.RunFrame()
+    void Invalidate(uint16_t address, int length); // blocks overlapping written bytes are checked again before they run
+
+    uint64_t nativeSteps;      // instructions run by compiled blocks
+    uint64_t interpretedSteps; // instructions handed to the interpreter
+
+private:
+    enum Check
+    {
+        UNCHECKED, // not compared with memory since the last write to it
+        GOOD,      // memory matches, runs compiled
+        BAD,       // memory was rewritten, interpreted until it changes again
+    };
+
+    // compiled instruction at an address, block is -1 if there is none
+    struct Entry
+    {
+        int16_t block;
+        uint8_t index; // instruction number inside the block
+    };
+
+    const Chip8AotModule &module;
+    const Chip8Quirks *profile;
+    Entry entries[4096];
+    bool covered[4096];          // bytes some block was compiled from
+    std::vector<uint8_t> checks; // Check per block
+
+    bool Usable(Chip8 &chip8, int block);
+};
+
+// a generated file holds one of these, constructing it registers the module
+struct Chip8AotRegistration
+{
+    Chip8AotRegistration(const Chip8AotModule *module) { Chip8Aot::Register(module); }
+};
@@ -0,0 +1,150 @@
+#include "audio.h"
+
+using namespace std;
+
+Chip8Audio::Chip8Audio(int sampleRate, size_t buffer)
+    : sampleRate(sampleRate), frequency(440), volume(3000), ring(buffer),
+      phase(0), leftover(0), generated(0), paused(true), underruns(0), overruns(0)
+{
+    scratch.resize(sampleRate / 60 + 1);
+}
+
+void Chip8Audio::Frame(const Chip8 &chip8)
+{
+    // sampleRate / 60 samples, the remainder carried so every second comes out whole
+    leftover += sampleRate;
+    size_t count = leftover / 60;
+    leftover %= 60;
+
+    if (chip8.soundTimer > 0)
+    {
+        uint32_t step = (uint64_t)frequency * (1ull << 32) / sampleRate;
+        for (size_t i = 0; i < count; i++)
+        {
+            scratch[i] = phase & 0x80000000 ? volume : -volume;
+            phase += step;
+        }
+    }
+    else
+    {
+        memset(scratch.data(), 0, count * sizeof(int16_t));
+        phase = 0; // next beep starts at the top of a period
+    }
+    generated += count;
+
+    size_t pushed = ring.Push(scratch.data(), count);
+    if (pushed < count)
+        overruns.fetch_add(count - pushed, memory_order_relaxed);
+    paused.store(false, memory_order_relaxed);
+}
+
+void Chip8Audio::Pause()
+{
+    paused.store(true, memory_order_relaxed);
+}
+
+void Chip8Audio::Pull(int16_t *samples, size_t count)
+{
+    size_t got = ring.Pop(samples, count);
+    if (got == count)
+        return;
+    memset(samples + got, 0, (count - got) * sizeof(int16_t));
+    if (!paused.load(memory_order_relaxed))
+        underruns.fetch_add(count - got, memory_order_relaxed);
+}
+
+size_t Chip8Audio::Buffered() const
+{
+    return ring.Size();
+}
+
+uint64_t Chip8Audio::Underruns() const
+{
+    return underruns.load(memory_order_relaxed);
+}
+
+uint64_t Chip8Audio::Overruns() const
+{
+    return overruns.load(memory_order_relaxed);
+}
+
+uint64_t Chip8Audio::Generated() const
+{
+    return generated;
+}
+
+Chip8WavWriter::Chip8WavWriter() : file(NULL), rate(0), samples(0), ok(true)
+{
+}
+
+Chip8WavWriter::~Chip8WavWriter()
+{
+    Close();
+}
+
+bool Chip8WavWriter::Open(const char *path, int sampleRate)
+{
+    Close();
+    file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    rate = sampleRate;
+    samples = 0;
+    ok = true;
+    Header(); // sizes are 0 until Close() comes back and fixes them
+    return ok;
+}
+
+void Chip8WavWriter::Write(const int16_t *data, size_t count)
+{
+    if (file == NULL)
+        return;
+    // little endian on disk whatever the host is
+    uint8_t bytes[512];
+    for (size_t i = 0; i < count; i += 256)
+    {
+        size_t n = min(count - i, (size_t)256);
+        for (size_t j = 0; j < n; j++)
+        {
+            bytes[2 * j] = data[i + j] & 0xFF;
+            bytes[2 * j + 1] = (uint16_t)data[i + j] >> 8;
+        }
+        ok &= fwrite(bytes, 2, n, file) == n;
+    }
+    samples += count;
+}
+
+bool Chip8WavWriter::Close()
+{
+    if (file == NULL)
+        return ok;
+    fseek(file, 0, SEEK_SET);
+    Header();
+    ok &= fclose(file) == 0;
+    file = NULL;
+    return ok;
+}
+
+void Chip8WavWriter::Header()
+{
+    uint32_t dataBytes = samples * 2;
+    uint8_t header[44];
+    auto put = [&](int at, uint32_t value, int size)
+    {
+        for (int i = 0; i < size; i++)
+            header[at + i] = value >> (8 * i);
+    };
+    memcpy(header, "RIFF", 4);
+    put(4, 36 + dataBytes, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put(16, 16, 4);       // fmt chunk size
+    put(20, 1, 2);        // PCM
+    put(22, 1, 2);        // mono
+    put(24, rate, 4);     // samples per second
+    put(28, rate * 2, 4); // bytes per second
+    put(32, 2, 2);        // bytes per sample
+    put(34, 16, 2);       // bits per sample
+    memcpy(header + 36, "data", 4);
+    put(40, dataBytes, 4);
+    ok &= fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
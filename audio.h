@@ -0,0 +1,61 @@
+#pragma once
+
+#include "chip8.h"
+#include "ring.h"
+
+// square wave beep for as long as soundTimer is running
+// the emulation thread makes one 60 Hz frame of samples at a time with Frame(), whatever
+// plays them (an SDL callback, a WAV file, nothing) takes them out with Pull(), the two
+// only share a lock free ring so neither side ever waits on the other
+class Chip8Audio
+{
+public:
+    Chip8Audio(int sampleRate = 44100, size_t buffer = 4096); // buffer is in samples, rounded up to a power of 2
+
+    int sampleRate;
+    int frequency;  // beep pitch in Hz
+    int16_t volume; // square wave amplitude
+
+    // producer side
+    void Frame(const Chip8 &chip8); // samples for one frame at the machine's current soundTimer
+    void Pause();                   // no frames coming for a while, running dry isn't an underrun until the next one
+
+    // consumer side
+    void Pull(int16_t *samples, size_t count); // anything not there yet plays as silence
+
+    size_t Buffered() const;     // samples waiting in the ring
+    uint64_t Underruns() const;  // samples the consumer wanted that weren't there
+    uint64_t Overruns() const;   // samples dropped because the ring was full
+    uint64_t Generated() const;  // samples made by Frame()
+
+private:
+    SpscRing<int16_t> ring;
+    std::vector<int16_t> scratch; // one frame of samples on the way into the ring
+    uint32_t phase;               // position in the wave, a whole period is 2^32
+    uint32_t leftover;            // sampleRate / 60 carried between frames, in 60ths of a sample
+    uint64_t generated;
+
+    std::atomic<bool> paused;
+    std::atomic<uint64_t> underruns; // written by the consumer only
+    std::atomic<uint64_t> overruns;  // written by the producer only
+};
+
+// 16 bit mono PCM to a .wav file, the sizes in the header are filled in by Close()
+class Chip8WavWriter
+{
+public:
+    Chip8WavWriter();
+    ~Chip8WavWriter();
+
+    bool Open(const char *path, int sampleRate);
+    void Write(const int16_t *samples, size_t count);
+    bool Close(); // false if anything failed to write, true if nothing was open
+
+private:
+    FILE *file;
+    int rate;
+    uint32_t samples;
+    bool ok;
+
+    void Header(); // RIFF header for the samples written so far
+};
@@ -0,0 +1,329 @@
+#include "chip8.h"
+#include "romcache.h"
+#include <deque>
+#include <mutex>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+// batch runner, runs many (ROM, input script, cycle budget) jobs on all cores
+// job file has one job per line: <ROM file> <input script or -> <cycles>
+// input script has one event per line: <cycle> <key 0-F> <1 down | 0 up>
+
+struct KeyEvent
+{
+    uint64_t cycle;
+    int key;
+    int down;
+};
+
+struct Job
+{
+    string rom;
+    string script;
+    uint64_t cycles;
+
+    // filled in by the worker
+    uint64_t romHash; // FNV-1a of the ROM file, tells apart different files under the same name
+    uint64_t hash;
+    double seconds;
+    bool ok;
+};
+
+// one deque per worker, the owner works from the back and thieves take from the front
+struct WorkQueue
+{
+    mutex lock;
+    deque<int> jobs;
+};
+
+static vector<Job> jobs;
+static vector<WorkQueue *> queues;
+static vector<int> cpus; // CPUs this process may run on, workers are pinned round robin over them
+static const Chip8Quirks *quirks = &QUIRKS_DEFAULT; // same profile for every job
+
+#ifdef CHIP8_STATS
+// counters summed over every finished job
+static mutex statsLock;
+static Chip8Stats *totalStats;
+static const char *statsPath;
+#endif
+
+static bool LoadScript(const string &path, vector<KeyEvent> &events)
+{
+    if (path == "-")
+        return true;
+
+    FILE *in = fopen(path.c_str(), "r");
+    if (in == NULL)
+        return false;
+
+    KeyEvent e;
+    unsigned long long cycle;
+    while (fscanf(in, "%llu %x %d", &cycle, &e.key, &e.down) == 3)
+    {
+        e.cycle = cycle;
+        e.key &= 0xF;
+        events.push_back(e);
+    }
+    fclose(in);
+
+    stable_sort(events.begin(), events.end(), [](const KeyEvent &a, const KeyEvent &b)
+                { return a.cycle < b.cycle; });
+    return true;
+}
+
+// run up to a cycle count, ticking the timers at every frame boundary on the way
+static void RunTo(Chip8 *chip8, uint64_t &done, uint64_t until)
+{
+    uint64_t perFrame = chip8->instructionsPerFrame;
+    while (done < until)
+    {
+        uint64_t frameEnd = (done / perFrame + 1) * perFrame;
+        uint64_t stop = min(frameEnd, until);
+        chip8->Run(stop - done);
+        done = stop;
+        if (done == frameEnd)
+            chip8->TickTimers();
+    }
+}
+
+static void RunJob(Job &job, Chip8 *chip8)
+{
+    auto start = chrono::steady_clock::now();
+
+    // ROMs come from the shared cache, only the first job using one reads the file
+    vector<KeyEvent> events;
+    const Chip8Rom *rom = Chip8RomCache::Shared().Load(job.rom.c_str());
+    job.ok = LoadScript(job.script, events) && rom != NULL;
+    if (!job.ok)
+        return;
+    job.romHash = rom->hash;
+
+    // reset copies the ROM's power on image over whatever the last job left
+    chip8->ResetCPU(*rom);
+
+    // run up to each input event, apply it, carry on
+    uint64_t done = 0;
+    for (size_t i = 0; i <= events.size(); i++)
+    {
+        uint64_t until = i < events.size() ? min(events[i].cycle, job.cycles) : job.cycles;
+        RunTo(chip8, done, until);
+        if (i < events.size())
+            chip8->inputKeys[events[i].key] = events[i].down;
+    }
+
+    job.hash = chip8->Hash();
+#ifdef CHIP8_STATS
+    {
+        lock_guard<mutex> guard(statsLock);
+        totalStats->Add(chip8->stats);
+        if (statsPath != NULL && Chip8Stats::Requested())
+            totalStats->Write(statsPath); // kill -USR1 writes what has finished so far
+    }
+    chip8->stats.Clear();
+#endif
+
+    job.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static bool PopOwn(int worker, int &job)
+{
+    WorkQueue *q = queues[worker];
+    lock_guard<mutex> guard(q->lock);
+    if (q->jobs.empty())
+        return false;
+    job = q->jobs.back();
+    q->jobs.pop_back();
+    return true;
+}
+
+static bool Steal(int worker, int &job)
+{
+    // look at the other workers starting from the next one
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        WorkQueue *q = queues[(worker + i) % queues.size()];
+        lock_guard<mutex> guard(q->lock);
+        if (!q->jobs.empty())
+        {
+            job = q->jobs.front();
+            q->jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void Worker(int worker)
+{
+#ifdef __linux__
+    // keep each worker on one core so its machine stays in that core's cache
+    if (!cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[worker % cpus.size()], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    // one machine per worker, reused for every job it runs, nothing is shared between workers
+    Chip8 *chip8 = new Chip8();
+    chip8->SetQuirks(*quirks);
+
+    // no jobs are added once the workers start, so with nothing left to take everything
+    // left is already running on another worker and this one is done
+    int job;
+    while (PopOwn(worker, job) || Steal(worker, job))
+    {
+        RunJob(jobs[job], chip8);
+    }
+    delete chip8;
+}
+
+int main(int argc, char **argv)
+{
+    // Command usage
+    if (argc < 2)
+    {
+        cout << "Usage: chip8-batch <job file> [-t threads] [-o results.csv] [-S stats.json | stats.csv] [-q default|vip|chip48|schip|xochip]" << endl;
+        return 1;
+    }
+
+    int threads = thread::hardware_concurrency();
+    const char *outPath = NULL;
+    const char *countersPath = NULL;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "-t") == 0)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0)
+            outPath = argv[++i];
+        else if (strcmp(argv[i], "-S") == 0)
+            countersPath = argv[++i];
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            quirks = Chip8::FindQuirks(argv[++i]);
+            if (quirks == NULL)
+            {
+                cout << "Unknown quirk profile " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+#ifndef CHIP8_STATS
+    if (countersPath != NULL)
+    {
+        cout << "Built without CHIP8_STATS, no counters to write" << endl;
+        return 1;
+    }
+#else
+    totalStats = new Chip8Stats();
+    statsPath = countersPath;
+    Chip8Stats::CatchSignal();
+#endif
+
+    // read job list
+    ifstream list(argv[1]);
+    if (!list)
+    {
+        cout << "Could not open " << argv[1] << endl;
+        return 1;
+    }
+    Job job = Job();
+    while (list >> job.rom >> job.script >> job.cycles)
+    {
+        jobs.push_back(job);
+    }
+
+    // deal jobs out round robin, stealing evens out whatever is left
+    for (int i = 0; i < threads; i++)
+    {
+        queues.push_back(new WorkQueue());
+    }
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        queues[i % threads]->jobs.push_back(i);
+    }
+#ifdef __linux__
+    // taskset and cgroups can leave fewer CPUs than the machine has, and not the first ones
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+        }
+    }
+#endif
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int i = 0; i < threads; i++)
+    {
+        workers.push_back(thread(Worker, i));
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // per job results, in job file order
+    FILE *out = outPath != NULL ? fopen(outPath, "w") : stdout;
+    if (out == NULL)
+    {
+        cout << "Could not open " << outPath << endl;
+        return 1;
+    }
+    fprintf(out, "job,rom,rom_hash,cycles,hash,seconds\n");
+    uint64_t totalCycles = 0;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        Job &j = jobs[i];
+        if (j.ok)
+        {
+            fprintf(out, "%zu,%s,%016llx,%llu,%016llx,%.6f\n", i, j.rom.c_str(), (unsigned long long)j.romHash,
+                    (unsigned long long)j.cycles, (unsigned long long)j.hash, j.seconds);
+            totalCycles += j.cycles;
+        }
+        else
+        {
+            fprintf(out, "%zu,%s,,%llu,error,0\n", i, j.rom.c_str(), (unsigned long long)j.cycles);
+        }
+    }
+    if (out != stdout)
+        fclose(out);
+
+#ifdef CHIP8_STATS
+    if (countersPath != NULL && !totalStats->Write(countersPath))
+    {
+        cout << "Could not write " << countersPath << endl;
+        return 1;
+    }
+#endif
+
+    fprintf(stderr, "%zu jobs on %d threads in %.3f s, %.0f instructions/sec\n",
+            jobs.size(), threads, seconds, seconds > 0 ? totalCycles / seconds : 0.0);
+    return 0;
+}
@@ -0,0 +1,266 @@
+#include "chip8.h"
+#include <algorithm>
+
+using namespace std;
+
+// benchmark suite, reports ns per emulated instruction for the interpreter core
+// micro benchmarks loop one opcode, macro benchmarks run small synthetic programs
+// and any ROM files given on the command line
+// every benchmark is warmed up, sized to take at least -t ms per repetition and
+// repeated -r times, the median is the number to track
+
+struct Benchmark
+{
+    string name;
+    string kind;          // micro or macro
+    vector<uint8_t> rom;  // loaded at 0x200
+    bool frames;          // run in 60 Hz frames, timers included (ROM files)
+    bool uncached;        // feed rom through DecodeOpcode instead of Run
+};
+
+struct Result
+{
+    uint64_t instructions; // per repetition
+    vector<double> ns;     // per instruction, one per repetition
+};
+
+static vector<uint8_t> Bytes(const vector<uint16_t> &ops)
+{
+    vector<uint8_t> bytes;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        bytes.push_back(ops[i] >> 8);
+        bytes.push_back(ops[i] & 0xFF);
+    }
+    return bytes;
+}
+
+// setup once, then body over and over in a loop closed by a jump
+static vector<uint16_t> Loop(const vector<uint16_t> &setup, const vector<uint16_t> &body, int times)
+{
+    vector<uint16_t> ops = setup;
+    uint16_t top = Chip8State::START_ADDRESS + 2 * ops.size();
+    for (int i = 0; i < times; i++)
+        ops.insert(ops.end(), body.begin(), body.end());
+    ops.push_back(0x1000 | top);
+    return ops;
+}
+
+static Benchmark Micro(const char *name, const vector<uint16_t> &setup, uint16_t opcode)
+{
+    Benchmark b = {name, "micro", Bytes(Loop(setup, {opcode}, 64)), false, false};
+    return b;
+}
+
+static Benchmark Macro(const char *name, const vector<uint16_t> &ops)
+{
+    Benchmark b = {name, "macro", Bytes(ops), false, false};
+    return b;
+}
+
+static vector<Benchmark> Suite()
+{
+    vector<Benchmark> suite;
+
+    // single opcodes, 64 in a row then a jump back
+    suite.push_back(Micro("DXYN", {0xA050, 0x600A, 0x6108}, 0xD015)); // draws and erases the same 8x5 sprite
+    suite.push_back(Micro("CXNN", {}, 0xC0FF));
+    suite.push_back(Micro("FX55", {0xA800}, 0xF755)); // data area, well away from the code
+    suite.push_back(Micro("FX65", {0xA800}, 0xF765));
+    suite.push_back(Micro("8XY4", {0x6001, 0x6103}, 0x8014));
+
+    // high-res screen work, sprite and scrolls over a 128x64 screen
+    suite.push_back(Micro("DXY0", {0x00FF, 0xA050, 0x6078, 0x6128}, 0xD010)); // 16x16, across the right and bottom edges
+    suite.push_back(Micro("00C4", {0x00FF}, 0x00C4));
+    suite.push_back(Micro("00FB", {0x00FF}, 0x00FB));
+    suite.push_back(Micro("00FC", {0x00FF}, 0x00FC));
+
+    // opcode dispatch, a mix of cheap opcodes through the decode cache and without it
+    vector<uint16_t> mix = {0x6012, 0x7101, 0x8014, 0xA300, 0xF01E, 0x8123, 0x7203, 0x8215};
+    Benchmark cached = {"dispatch", "micro", Bytes(Loop({}, mix, 8)), false, false};
+    Benchmark uncached = {"dispatch-uncached", "micro", Bytes(mix), false, true};
+    suite.push_back(cached);
+    suite.push_back(uncached);
+
+    // arithmetic and register moves only
+    suite.push_back(Macro("alu", Loop({0x6001, 0x6102, 0x6203},
+                                      {0x7001, 0x8014, 0x8121, 0x8232, 0x8303, 0x8415, 0x8506, 0x8647, 0x870E, 0xA123, 0xF31E}, 4)));
+
+    // a sprite moving across the screen and a changing digit, cleared every pass
+    suite.push_back(Macro("sprites", Loop({0xA050},
+                                          {0xD015, 0x7005, 0x7103, 0xD015, 0xF229, 0xD235, 0x7201, 0xD235, 0xA050, 0x00E0}, 1)));
+
+    // a counting loop then a sprite draw and a register reset, all sequences the interpreter fuses
+    suite.push_back(Macro("fused", {0x6000, 0x6100, 0x6200, 0x7001, 0x3040, 0x1206, 0xA050, 0xD125, 0x6000, 0x6100, 0x1206}));
+
+    // nested subroutine calls, main loop at 0x200, subroutines at 0x300 and 0x310
+    vector<uint16_t> calls = Loop({}, {0x2300, 0x7001, 0x2310}, 8);
+    calls.resize(0x80, 0x0000);
+    calls.insert(calls.end(), {0x2310, 0x7101, 0x2310, 0x00EE, 0x0000, 0x0000, 0x0000, 0x0000});
+    calls.insert(calls.end(), {0x7201, 0x8124, 0x00EE});
+    suite.push_back(Macro("calls", calls));
+
+    return suite;
+}
+
+// names are ROM paths as given, which can hold anything, Windows paths backslashes
+static string JsonString(const string &s)
+{
+    string out = "\"";
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        char c = s[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static string CsvField(const string &s)
+{
+    if (s.find_first_of(",\"\r\n") == string::npos)
+        return s;
+    string out = "\"";
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        if (s[i] == '"')
+            out += '"'; // doubled inside quotes
+        out += s[i];
+    }
+    return out + "\"";
+}
+
+static Result Measure(const Benchmark &b, int repetitions, double minSeconds)
+{
+    // a ROM waiting on a key or the delay timer would otherwise time skipped passes round its
+    // idle loop, not instructions, and the figure would move with how long it waits
+    Chip8 *chip8 = new Chip8();
+    chip8->skipIdle = false;
+    chip8->ResetCPU(b.rom.data(), b.rom.size());
+    vector<uint16_t> opcodes;
+    for (size_t i = 0; i + 1 < b.rom.size(); i += 2)
+        opcodes.push_back((b.rom[i] << 8) | b.rom[i + 1]);
+
+    auto run = [&](uint64_t n)
+    {
+        auto start = chrono::steady_clock::now();
+        if (b.uncached)
+        {
+            for (uint64_t i = 0; i < n; i++)
+                chip8->DecodeOpcode(opcodes[i % opcodes.size()]);
+        }
+        else if (b.frames)
+        {
+            for (uint64_t i = 0; i < n; i += chip8->instructionsPerFrame)
+                chip8->RunFrame();
+        }
+        else
+        {
+            chip8->Run(n);
+        }
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+
+    // warm up and size a repetition, doubling until it takes long enough to time reliably
+    uint64_t n = 1 << 16;
+    while (run(n) < minSeconds && n < (1ull << 40))
+        n *= 2;
+    if (b.frames) // whole frames only
+        n = (n + chip8->instructionsPerFrame - 1) / chip8->instructionsPerFrame * chip8->instructionsPerFrame;
+
+    Result result;
+    result.instructions = n;
+    for (int i = 0; i < repetitions; i++)
+        result.ns.push_back(run(n) * 1e9 / n);
+
+    delete chip8;
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int repetitions = 9;
+    double minSeconds = 0.05;
+    bool json = false;
+    vector<Benchmark> suite = Suite();
+    const char *only = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0)
+        {
+            json = true;
+            continue;
+        }
+        if (argv[i][0] != '-')
+        {
+            // a ROM file, run it the way the frontend would
+            FILE *in = fopen(argv[i], "rb");
+            if (in == NULL)
+            {
+                cout << "Could not open " << argv[i] << endl;
+                return 1;
+            }
+            Benchmark b = {argv[i], "rom", vector<uint8_t>(sizeof(Chip8State::memory) - Chip8State::START_ADDRESS), true, false};
+            b.rom.resize(fread(b.rom.data(), 1, b.rom.size(), in));
+            fclose(in);
+            suite.push_back(b);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "-r") == 0)
+            repetitions = max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "-t") == 0)
+            minSeconds = atof(argv[++i]) / 1000;
+        else if (strcmp(argv[i], "-b") == 0)
+            only = argv[++i];
+        else
+        {
+            cout << "Usage: chip8-bench [-r repetitions] [-t ms per repetition] [-b benchmark] [-j] [ROM files...]" << endl;
+            return 1;
+        }
+    }
+
+    // CSV by default, one JSON object per benchmark with -j
+    if (!json)
+        printf("name,kind,instructions,repetitions,median_ns,min_ns,max_ns\n");
+    for (size_t i = 0; i < suite.size(); i++)
+    {
+        Benchmark &b = suite[i];
+        if (only != NULL && b.name != only)
+            continue;
+
+        Result r = Measure(b, repetitions, minSeconds);
+        vector<double> sorted = r.ns;
+        sort(sorted.begin(), sorted.end());
+        double median = sorted[sorted.size() / 2];
+
+        if (json)
+            printf("{\"name\": %s, \"kind\": \"%s\", \"instructions\": %llu, \"repetitions\": %d, "
+                   "\"median_ns\": %.4f, \"min_ns\": %.4f, \"max_ns\": %.4f}\n",
+                   JsonString(b.name).c_str(), b.kind.c_str(), (unsigned long long)r.instructions, repetitions,
+                   median, sorted.front(), sorted.back());
+        else
+            printf("%s,%s,%llu,%d,%.4f,%.4f,%.4f\n", CsvField(b.name).c_str(), b.kind.c_str(),
+                   (unsigned long long)r.instructions, repetitions, median, sorted.front(), sorted.back());
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include "capture.h"
+
+using namespace std;
+
+static const int WORDS = sizeof(Chip8CaptureFrame::video) / 8;
+static const char MAGIC[4] = {'C', '8', 'V', 1};
+
+static void PutCount(vector<uint8_t> &out, size_t count)
+{
+    // 7 bits per byte, high bit set on all but the last
+    while (count >= 0x80)
+    {
+        out.push_back((count & 0x7F) | 0x80);
+        count >>= 7;
+    }
+    out.push_back(count);
+}
+
+// same into a buffer with room, returns the new size
+static size_t PutCount(uint8_t *out, size_t size, size_t count)
+{
+    while (count >= 0x80)
+    {
+        out[size++] = (count & 0x7F) | 0x80;
+        count >>= 7;
+    }
+    out[size++] = count;
+    return size;
+}
+
+// false if it runs past end or is longer than a size_t
+static bool GetCount(const uint8_t *&in, const uint8_t *end, size_t &count)
+{
+    count = 0;
+    for (int shift = 0; shift < 64 && in < end; shift += 7)
+    {
+        uint8_t byte = *in++;
+        count |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static const uint64_t *Words(const Chip8CaptureFrame &frame)
+{
+    return &frame.video[0][0][0];
+}
+
+Chip8Capture::Chip8Capture(size_t buffer)
+    : ring(buffer), closing(false), file(NULL), ok(true), frames(0), stalls(0), bytes(0)
+{
+}
+
+Chip8Capture::~Chip8Capture()
+{
+    Close();
+}
+
+bool Chip8Capture::Open(const char *path)
+{
+    Close();
+    file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    ok = fwrite(MAGIC, 1, sizeof(MAGIC), file) == sizeof(MAGIC);
+    bytes = sizeof(MAGIC);
+    frames = 0;
+    stalls = 0;
+    memset(&previous, 0, sizeof(previous));
+    closing = false;
+    encoder = thread(&Chip8Capture::Encode, this);
+    return ok;
+}
+
+void Chip8Capture::Frame(const Chip8State &chip8)
+{
+    if (file == NULL)
+        return;
+    Chip8CaptureFrame *slot = ring.Claim();
+    if (slot == NULL)
+    {
+        // encoder is behind, wait for it rather than leave a hole in the recording
+        stalls++;
+        while ((slot = ring.Claim()) == NULL)
+        {
+            wake.notify_one();
+            this_thread::yield();
+        }
+    }
+    memcpy(slot->video, chip8.video, sizeof(slot->video));
+    slot->hires = chip8.hires;
+    ring.Commit();
+    frames++;
+}
+
+bool Chip8Capture::Close()
+{
+    if (file == NULL)
+        return ok;
+    closing = true;
+    wake.notify_one();
+    encoder.join();
+    ok &= fclose(file) == 0;
+    file = NULL;
+    return ok;
+}
+
+uint64_t Chip8Capture::Frames() const
+{
+    return frames;
+}
+
+uint64_t Chip8Capture::Bytes() const
+{
+    return bytes.load(memory_order_relaxed);
+}
+
+uint64_t Chip8Capture::Stalls() const
+{
+    return stalls;
+}
+
+void Chip8Capture::Record(const Chip8CaptureFrame *previous, const Chip8CaptureFrame &frame, vector<uint8_t> &out)
+{
+    static const Chip8CaptureFrame blank = {};
+    const uint64_t *from = Words(previous != NULL ? *previous : blank);
+    const uint64_t *to = Words(frame);
+
+    // same scheme as Chip8Rewind, runs of unchanged and changed words, trailing unchanged ones left out
+    uint8_t payload[WORDS * 8 + WORDS * 4]; // every word changed, counts of at most 256 take 2 bytes
+    size_t size = 0;
+    int i = 0;
+    while (i < WORDS)
+    {
+        int skip = i;
+        while (i < WORDS && from[i] == to[i])
+            i++;
+        if (i == WORDS)
+            break;
+
+        int first = i;
+        while (i < WORDS && from[i] != to[i])
+            i++;
+
+        size = PutCount(payload, size, first - skip);
+        size = PutCount(payload, size, i - first);
+        for (int j = first; j < i; j++)
+        {
+            uint64_t change = from[j] ^ to[j];
+            for (int shift = 56; shift >= 0; shift -= 8)
+                payload[size++] = change >> shift;
+        }
+    }
+
+    out.push_back((frame.hires ? 1 : 0) | (previous == NULL ? 2 : 0));
+    PutCount(out, size);
+    out.insert(out.end(), payload, payload + size);
+}
+
+// encoder thread, drains the ring until Close() and the ring is empty
+void Chip8Capture::Encode()
+{
+    for (;;)
+    {
+        bool last = closing.load(); // read before looking, a frame committed before Close() is seen
+        const Chip8CaptureFrame *frame = ring.Peek();
+        if (frame == NULL)
+        {
+            if (last)
+                return;
+            unique_lock<mutex> lock(wakeLock);
+            wake.wait_for(lock, chrono::milliseconds(1));
+            continue;
+        }
+
+        record.clear();
+        Record(&previous, *frame, record);
+        previous = *frame;
+        ring.Release();
+
+        ok &= fwrite(record.data(), 1, record.size(), file) == record.size();
+        bytes.fetch_add(record.size(), memory_order_relaxed);
+    }
+}
+
+Chip8CaptureReader::Chip8CaptureReader() : file(NULL), broken(false)
+{
+}
+
+Chip8CaptureReader::~Chip8CaptureReader()
+{
+    Close();
+}
+
+bool Chip8CaptureReader::Open(const char *path)
+{
+    Close();
+    file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    char magic[sizeof(MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        Close();
+        return false;
+    }
+    memset(&current, 0, sizeof(current));
+    broken = false;
+    return true;
+}
+
+void Chip8CaptureReader::Close()
+{
+    if (file != NULL)
+        fclose(file);
+    file = NULL;
+}
+
+bool Chip8CaptureReader::Broken() const
+{
+    return broken;
+}
+
+bool Chip8CaptureReader::Next(Chip8CaptureFrame &frame)
+{
+    if (file == NULL)
+        return false;
+
+    int flags = fgetc(file);
+    if (flags == EOF)
+        return false; // clean end
+    broken = true; // until the whole record checks out
+
+    size_t length = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        int byte = fgetc(file);
+        if (byte == EOF || shift >= 32)
+            return false;
+        length |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    payload.resize(length);
+    if (fread(payload.data(), 1, length, file) != length)
+        return false;
+
+    if (!Apply(current, flags, payload.data(), length))
+        return false;
+
+    broken = false;
+    frame = current;
+    return true;
+}
+
+bool Chip8CaptureReader::Apply(Chip8CaptureFrame &frame, uint8_t flags, const uint8_t *payload, size_t length)
+{
+    if (flags & 2)
+        memset(&frame, 0, sizeof(frame));
+
+    uint64_t *words = &frame.video[0][0][0];
+    const uint8_t *in = payload;
+    const uint8_t *end = in + length;
+    size_t i = 0;
+    while (in < end)
+    {
+        size_t skip, changed;
+        if (!GetCount(in, end, skip) || !GetCount(in, end, changed))
+            return false;
+        if (skip > WORDS - i || changed > WORDS - i - skip || (size_t)(end - in) < changed * 8)
+            return false;
+        for (i += skip; changed > 0; changed--, i++)
+        {
+            uint64_t change = 0;
+            for (int b = 0; b < 8; b++)
+                change = (change << 8) | *in++;
+            words[i] ^= change;
+        }
+    }
+    frame.hires = flags & 1;
+    return true;
+}
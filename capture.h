@@ -0,0 +1,87 @@
+#pragma once
+
+#include "chip8.h"
+#include "ring.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// screen recording for headless runs, one record per frame in a .c8v file
+// the emulation thread only copies the framebuffer into a ring slot, a background thread
+// XORs it with the frame before and run-length codes the result, so a frame that didn't
+// change costs a few bytes, the emulation only waits if the encoder falls a whole ring behind
+//
+// file layout, "C8V" and a version byte, then per frame:
+//   [flags][payload length][payload]   flags bit 0 is hi-res, bit 1 a fresh start from a blank
+//                                      screen (never in files, streams use it to resync),
+//                                      length is a 7-bit varint
+// payload is a list of (unchanged words, changed words, XOR of each changed word) over the
+// 256 64-bit words of Chip8State::video (plane, row, half), counts are varints, words are
+// big endian so the bytes run in pixel order, the first frame is XORed with a blank screen
+// records are self-contained, a file cut short by a crash loses at most its last frame
+
+// the screen as the machine had it at the end of a frame
+struct Chip8CaptureFrame
+{
+    uint64_t video[Chip8State::PLANES][64][2];
+    uint8_t hires;
+};
+
+class Chip8Capture
+{
+public:
+    Chip8Capture(size_t buffer = 256); // frames in flight, rounded up to a power of 2
+    ~Chip8Capture();
+
+    bool Open(const char *path);        // starts the encoding thread
+    void Frame(const Chip8State &chip8); // record the screen, only waits if the ring is full
+    bool Close();                       // finishes writing, false if anything failed
+
+    // one record for frame, XORed with previous, appended to out, previous NULL for a fresh start
+    static void Record(const Chip8CaptureFrame *previous, const Chip8CaptureFrame &frame, std::vector<uint8_t> &out);
+
+    uint64_t Frames() const;  // frames handed in
+    uint64_t Bytes() const;   // bytes written so far
+    uint64_t Stalls() const;  // frames that waited for the encoder to make room
+
+private:
+    SpscRing<Chip8CaptureFrame> ring;
+    std::thread encoder;
+    std::atomic<bool> closing;
+    std::mutex wakeLock;        // the encoder sleeps on wake while the ring is empty,
+    std::condition_variable wake; // the emulation thread only notifies when it fills up
+    FILE *file;
+    bool ok;
+
+    uint64_t frames;
+    uint64_t stalls;
+    std::atomic<uint64_t> bytes; // written by the encoder only
+
+    // encoder thread only
+    Chip8CaptureFrame previous;
+    std::vector<uint8_t> record;
+
+    void Encode();
+};
+
+// reads a .c8v file back a frame at a time
+class Chip8CaptureReader
+{
+public:
+    Chip8CaptureReader();
+    ~Chip8CaptureReader();
+
+    bool Open(const char *path);
+    bool Next(Chip8CaptureFrame &frame); // false at the end of the file or on a broken record
+    bool Broken() const;                 // stopped on a damaged record rather than the end
+    void Close();
+
+    // applies one record's payload to frame, false if it doesn't fit the format
+    static bool Apply(Chip8CaptureFrame &frame, uint8_t flags, const uint8_t *payload, size_t length);
+
+private:
+    FILE *file;
+    bool broken;
+    Chip8CaptureFrame current;
+    std::vector<uint8_t> payload;
+};
@@ -1,4 +1,12 @@
 #include "chip8.h"
+#include "jit.h"
+#include "aot.h"
+#include "trace.h"
+#include "romcache.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 // sprite data representing hexadecimal numbers, 4x5 pixels each
 uint8_t fontset[80] = {
@@ -20,32 +28,175 @@ uint8_t fontset[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-void Chip8::ResetCPU(char *filename)
+// SUPER-CHIP large digits, 8x10 pixels each, A to F as XO-CHIP has them
+uint8_t bigFontset[160] = {
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+bool Chip8::ResetCPU(char *filename)
+{
+    // the file is only read the first time, after that this is a copy of the image
+    const Chip8Rom *rom = Chip8RomCache::Shared().Load(filename);
+    if (rom == NULL)
+        return false;
+    ResetCPU(*rom);
+    return true;
+}
+
+void Chip8::ResetCPU(const Chip8Rom &rom)
+{
+    // one copy of the image, whatever was decoded belonged to the last program
+    *static_cast<Chip8State *>(this) = rom.image;
+    InvalidateCode(0, sizeof(memory));
+    MarkDirty(0, 63);
+    Seed(seed); // image was booted with some other machine's seed
+}
+
+void Chip8::ResetCPU(const uint8_t *rom, size_t size)
+{
+    Boot();
+
+    if (size > sizeof(memory) - START_ADDRESS)
+        size = sizeof(memory) - START_ADDRESS;
+    memcpy(&memory[START_ADDRESS], rom, size);
+}
+
+void Chip8::Boot()
 {
     indexRegister = 0;
     programCounter = START_ADDRESS;          // instructions start here
     memset(registers, 0, sizeof(registers)); // reset registers for use
+    Seed(seed);
+
+    // nothing left over from the last program
+    memset(memory, 0, sizeof(memory));
+    memset(video, 0, sizeof(video));
+    memset(inputKeys, 0, sizeof(inputKeys));
+    stackSize = 0;
+    fault = FAULT_NONE;
+    delayTimer = 0;
+    soundTimer = 0;
+    opcode = 0;
+    memset(flags, 0, sizeof(flags));
+    hires = 0;
+    planes = 1;
+    memset(reserved, 0, sizeof(reserved)); // saved and diffed with the rest
 
-    FILE *in;
-    in = fopen(filename, "rb");
-    fread(&memory[START_ADDRESS], 0xfff, 1, in);
-    fclose(in);
+    // new program, nothing decoded yet
+    InvalidateCode(0, sizeof(memory));
+    MarkDirty(0, 63);
 
     // load fontset into memory, 0x50 to 0x9F popular convention apparently
     for (int i = 0; i < 80; i++)
     {
         memory[0x50 + i] = fontset[i];
     }
+    // large digits right after it, 0xA0 to 0x13F
+    memcpy(&memory[0xA0], bigFontset, sizeof(bigFontset));
 }
 
 void Chip8::Cycle()
 {
-    // fetch opcode
-    opcode = GetNextOpcode();
+    if (trace != NULL && trace->Sample())
+    {
+        trace->Before(*this);
+        Execute(1);
+        trace->After(*this);
+    }
+    else
+    {
+        Execute(1);
+    }
+}
+
+void Chip8::Run(uint64_t cycles)
+{
+    if (trace == NULL)
+    {
+        Execute(cycles);
+        return;
+    }
+
+    // logged instructions one at a time so every one shows, the idle loop skip would jump
+    // over some, whatever sampling leaves out in between at full speed
+    for (uint64_t i = 0; i < cycles;)
+    {
+        uint64_t gap = std::min<uint64_t>(trace->Gap(), cycles - i);
+        if (gap > 0)
+        {
+            Execute(gap);
+            trace->Skip(gap);
+            i += gap;
+        }
+        else
+        {
+            Cycle();
+            i++;
+        }
+    }
+}
+
+void Chip8::Execute(uint64_t cycles)
+{
+    idleLoop = 0;
+    for (uint64_t i = 0; i < cycles; i++)
+    {
+        // fetch instruction, decoding it the first time this address runs
+        Instruction &ins = decoded[programCounter & 0xFFF];
+        if (ins.handler == NULL)
+            ins = DecodeAt(programCounter);
+
+        // a fused sequence that would run past the end of the run goes one instruction at a time
+        if (ins.length > 1 && ins.length > cycles - i)
+        {
+            RunAlone(ins.opcode);
+        }
+        else
+        {
+            opcode = ins.opcode;
+            CHIP8_STAT(stats.Count(programCounter, opcode));
+            programCounter += 2; // next instruction is now 2 bytes over
+
+            // execute opcode
+            ins.handler(*this, ins);
+            if (ins.length > 1)
+                i += fusedRan - 1;
+        }
+
+        // nothing but input or a timer tick gets it out, skip round the loop to
+        // where it would have been at the end of the run
+        if (idleLoop != 0 && skipIdle)
+        {
+            uint64_t left = cycles - i - 1;
+            i += left - left % idleLoop;
+            CHIP8_STAT(stats.idleSkipped += left - left % idleLoop);
+        }
+    }
+}
 
-    // decode and execute opcode
-    DecodeOpcode(opcode);
+void Chip8::RunFrame()
+{
+    Run(instructionsPerFrame);
+    TickTimers();
+}
 
+void Chip8::TickTimers()
+{
     // decrease timers if applicable
     if (delayTimer > 0)
         delayTimer--;
@@ -53,144 +204,459 @@ void Chip8::Cycle()
         soundTimer--;
 }
 
+void Chip8::SetQuirks(const Chip8Quirks &profile)
+{
+    if (quirks == &profile)
+        return;
+    quirks = &profile;
+    InvalidateCode(0, sizeof(memory)); // every address was decoded with the old profile's handlers
+}
+
+const Chip8Quirks *Chip8::FindQuirks(const char *name)
+{
+    static const Chip8Quirks *profiles[] = {&QUIRKS_DEFAULT, &QUIRKS_VIP, &QUIRKS_CHIP48, &QUIRKS_SCHIP, &QUIRKS_XOCHIP};
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        if (strcmp(profiles[i]->name, name) == 0)
+            return profiles[i];
+    }
+    return NULL;
+}
+
+void Chip8::Seed(uint64_t value)
+{
+    seed = value;
+    // splitmix64 spreads small seeds over the whole state, xorshift must not start at 0
+    uint64_t z = value + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    randomState = z != 0 ? z : 1;
+}
+
+uint8_t Chip8::Random()
+{
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (randomState * 0x2545F4914F6CDD1Dull) >> 56; // top bits are the best ones
+}
+
+// FNV-1a over everything a ROM can observe
+uint64_t Chip8::HashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+uint64_t Chip8::Hash()
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    hash = HashBytes(hash, registers, sizeof(registers));
+    hash = HashBytes(hash, memory, sizeof(memory));
+    hash = HashBytes(hash, &indexRegister, sizeof(indexRegister));
+    hash = HashBytes(hash, &programCounter, sizeof(programCounter));
+    hash = HashBytes(hash, stack, stackSize * sizeof(uint16_t));
+    hash = HashBytes(hash, &delayTimer, sizeof(delayTimer));
+    hash = HashBytes(hash, &soundTimer, sizeof(soundTimer));
+    hash = HashBytes(hash, video, sizeof(video));
+    hash = HashBytes(hash, &randomState, sizeof(randomState));
+    hash = HashBytes(hash, flags, sizeof(flags));
+    hash = HashBytes(hash, &hires, sizeof(hires));
+    hash = HashBytes(hash, &planes, sizeof(planes));
+    return hash;
+}
+
+void Chip8::SaveState(Chip8State &state) const
+{
+    state = *this;
+}
+
+void Chip8::LoadState(const Chip8State &state)
+{
+    // only drop decoded instructions whose bytes actually change, rewinding a frame
+    // usually touches a few bytes of data and none of the code
+    for (int i = 0; i < 4096; i += 8)
+    {
+        if (memcmp(&memory[i], &state.memory[i], 8) != 0)
+            InvalidateCode(i, 8);
+    }
+
+    *static_cast<Chip8State *>(this) = state;
+    if (stackSize > 16)
+        stackSize = 16; // states may come from a file
+    MarkDirty(0, 63);
+}
+
+void Chip8::MarkDirty(int top, int bottom)
+{
+    if (!videoDirty)
+    {
+        videoDirty = true;
+        dirtyTop = top;
+        dirtyBottom = bottom;
+        return;
+    }
+    if (top < dirtyTop)
+        dirtyTop = top;
+    if (bottom > dirtyBottom)
+        dirtyBottom = bottom;
+}
+
+void Chip8::ClearDirty()
+{
+    videoDirty = false;
+}
+
+void Chip8::Halt(uint8_t reason)
+{
+    // stay on the faulting instruction for good, it fails the same way every time
+    // so idle loop detection makes the rest of the run free
+    fault = reason;
+    programCounter -= 2;
+    idleLoop = 1;
+}
+
+bool Chip8::TimerPoll(uint16_t address)
+{
+    uint16_t get = (memory[address & 0xFFF] << 8) | memory[(address + 1) & 0xFFF];
+    uint16_t test = (memory[(address + 2) & 0xFFF] << 8) | memory[(address + 3) & 0xFFF];
+    int x = (get >> 8) & 0xF;
+    if ((get & 0xF0FF) != 0xF007 || ((test >> 8) & 0xF) != x)
+        return false;
+
+    // VX already holds the timer and the skip falls through, the next pass does the same
+    uint8_t nn = test & 0xFF;
+    if (registers[x] != delayTimer)
+        return false;
+    if ((test & 0xF000) == 0x3000)
+        return registers[x] != nn;
+    if ((test & 0xF000) == 0x4000)
+        return registers[x] == nn;
+    return false;
+}
+
 uint16_t Chip8::GetNextOpcode()
 {
     uint16_t next;
-    next = memory[programCounter];      // get first byte of next instruction
-    next <<= 8;                         // shift over to receive next byte
-    next |= memory[programCounter + 1]; // get second byte of next instruction
-    programCounter += 2;                // next instruction is now 2 bytes over
+    next = memory[programCounter & 0xFFF];         // get first byte of next instruction
+    next <<= 8;                                    // shift over to receive next byte
+    next |= memory[(programCounter + 1) & 0xFFF];  // get second byte of next instruction
+    programCounter += 2;                           // next instruction is now 2 bytes over
     return next;
 }
 
-// 5 trillion switches
+void Chip8::RunAlone(uint16_t opcode)
+{
+    Instruction ins = Decode(opcode, *quirks);
+    this->opcode = opcode;
+    CHIP8_STAT(stats.Count(programCounter, opcode));
+    programCounter += 2;
+    ins.handler(*this, ins);
+}
+
 void Chip8::DecodeOpcode(uint16_t opcode)
 {
+    // uncached path, decode and run straight away
+    CHIP8_STAT(stats.Count(programCounter - 2, opcode));
+    Instruction ins = Decode(opcode, *quirks);
+    ins.handler(*this, ins);
+}
+
+void Chip8::InvalidateCode(uint16_t address, int length)
+{
+    // an instruction starting one byte before the write overlaps it too, and a fused
+    // sequence of up to 3 instructions starting 5 bytes before
+    for (int i = -5; i < length; i++)
+    {
+        decoded[(address + i) & 0xFFF].handler = NULL;
+    }
+    if (jit != NULL)
+        jit->Invalidate(address, length);
+    if (aot != NULL)
+        aot->Invalidate(address, length);
+    if (trace != NULL)
+        trace->Wrote(address, length);
+}
+
+#define HANDLER(op) &Chip8::Call<&Chip8::op>
+
+// the profile is picked here, once per address, the handlers it leads to never test it
+Chip8::Instruction Chip8::Decode(uint16_t opcode, const Chip8Quirks &profile)
+{
+    if (&profile == &QUIRKS_VIP)
+        return DecodeAs<QUIRKS_VIP>(opcode);
+    if (&profile == &QUIRKS_CHIP48)
+        return DecodeAs<QUIRKS_CHIP48>(opcode);
+    if (&profile == &QUIRKS_SCHIP)
+        return DecodeAs<QUIRKS_SCHIP>(opcode);
+    if (&profile == &QUIRKS_XOCHIP)
+        return DecodeAs<QUIRKS_XOCHIP>(opcode);
+    return DecodeAs<QUIRKS_DEFAULT>(opcode);
+}
+
+// same profile dispatch for the fused decode
+Chip8::Instruction Chip8::DecodeAt(uint16_t address)
+{
+    if (quirks == &QUIRKS_VIP)
+        return FuseAs<QUIRKS_VIP>(address);
+    if (quirks == &QUIRKS_CHIP48)
+        return FuseAs<QUIRKS_CHIP48>(address);
+    if (quirks == &QUIRKS_SCHIP)
+        return FuseAs<QUIRKS_SCHIP>(address);
+    if (quirks == &QUIRKS_XOCHIP)
+        return FuseAs<QUIRKS_XOCHIP>(address);
+    return FuseAs<QUIRKS_DEFAULT>(address);
+}
+
+#define FUSED(...) &Chip8::Fused<__VA_ARGS__>
+
+// superinstructions, a few sequences nearly every ROM spends its time in become one handler
+// so Run dispatches once for the lot: ANNN + DXYN sprite draws, runs of 6XNN, and
+// 7XNN or FX07 + 3XNN or 4XNN + 1NNN counter loops and delay timer waits
+template <const Chip8Quirks &Q>
+Chip8::Instruction Chip8::FuseAs(uint16_t address)
+{
+    address &= 0xFFF;
+    Instruction ins = DecodeAs<Q>((memory[address] << 8) | memory[(address + 1) & 0xFFF]);
+    if (address + 5 > 0xFFF)
+        return ins; // no wrapping round the end of memory
+    Instruction next[2] = {DecodeAs<Q>((memory[address + 2] << 8) | memory[address + 3]),
+                           DecodeAs<Q>((memory[address + 4] << 8) | memory[address + 5])};
+    Handler a = ins.handler, b = next[0].handler, c = next[1].handler;
+
+    Handler fused = NULL;
+    int length = 3;
+    bool counter = a == HANDLER(Opcode_7XNN) || a == HANDLER(Opcode_FX07);
+    if (a == HANDLER(Opcode_ANNN) && b == HANDLER(Opcode_DXYN<Q>))
+        fused = FUSED(&Chip8::Opcode_ANNN, &Chip8::Opcode_DXYN<Q>), length = 2;
+    else if (a == HANDLER(Opcode_6XNN) && b == HANDLER(Opcode_6XNN) && c == HANDLER(Opcode_6XNN))
+        fused = FUSED(&Chip8::Opcode_6XNN, &Chip8::Opcode_6XNN, &Chip8::Opcode_6XNN);
+    else if (a == HANDLER(Opcode_6XNN) && b == HANDLER(Opcode_6XNN))
+        fused = FUSED(&Chip8::Opcode_6XNN, &Chip8::Opcode_6XNN), length = 2;
+    else if (counter && b == HANDLER(Opcode_3XNN) && c == HANDLER(Opcode_1NNN))
+        fused = a == HANDLER(Opcode_7XNN) ? FUSED(&Chip8::Opcode_7XNN, &Chip8::Opcode_3XNN, &Chip8::Opcode_1NNN)
+                                          : FUSED(&Chip8::Opcode_FX07, &Chip8::Opcode_3XNN, &Chip8::Opcode_1NNN);
+    else if (counter && b == HANDLER(Opcode_4XNN) && c == HANDLER(Opcode_1NNN))
+        fused = a == HANDLER(Opcode_7XNN) ? FUSED(&Chip8::Opcode_7XNN, &Chip8::Opcode_4XNN, &Chip8::Opcode_1NNN)
+                                          : FUSED(&Chip8::Opcode_FX07, &Chip8::Opcode_4XNN, &Chip8::Opcode_1NNN);
+    if (fused == NULL)
+        return ins;
+
+    // the fused handler reads the later instructions' operands from the cache, a write to any
+    // of them drops this entry along with theirs
+    for (int i = 0; i < length - 1; i++)
+    {
+        Instruction &later = decoded[address + 2 + 2 * i];
+        if (later.handler == NULL)
+            later = next[i];
+    }
+    ins.handler = fused;
+    ins.length = length;
+    return ins;
+}
+
+#undef FUSED
+
+// 5 trillion switches, but only once per address now
+template <const Chip8Quirks &Q>
+Chip8::Instruction Chip8::DecodeAs(uint16_t opcode)
+{
+    Instruction ins;
+    ins.opcode = opcode;
+    ins.nnn = opcode & 0x0FFF;
+    ins.x = (opcode & 0x0F00) >> 8;
+    ins.y = (opcode & 0x00F0) >> 4;
+    ins.nn = opcode & 0x00FF;
+    ins.n = opcode & 0x000F;
+    ins.length = 1;
+    ins.handler = HANDLER(Opcode_NONE);
+
     // start with first digit of opcode
     switch (opcode & 0xF000)
     {
     case 0x0000:
+        switch (opcode & 0xFFF0)
+        {
+        case 0x00C0:
+            ins.handler = HANDLER(Opcode_00CN);
+            return ins;
+        case 0x00D0:
+            ins.handler = HANDLER(Opcode_00DN);
+            return ins;
+        }
+        switch (opcode)
+        {
+        case 0x00FB:
+            ins.handler = HANDLER(Opcode_00FB);
+            return ins;
+        case 0x00FC:
+            ins.handler = HANDLER(Opcode_00FC);
+            return ins;
+        case 0x00FD:
+            ins.handler = HANDLER(Opcode_00FD);
+            return ins;
+        case 0x00FE:
+            ins.handler = HANDLER(Opcode_00FE);
+            return ins;
+        case 0x00FF:
+            ins.handler = HANDLER(Opcode_00FF);
+            return ins;
+        }
         switch (opcode & 0x000F)
         {
         case 0x0000:
-            Opcode_00E0(opcode);
+            ins.handler = HANDLER(Opcode_00E0);
             break;
         case 0x000E:
-            Opcode_00EE(opcode);
+            ins.handler = HANDLER(Opcode_00EE);
             break;
         }
         break;
     case 0x1000:
-        Opcode_1NNN(opcode);
+        ins.handler = HANDLER(Opcode_1NNN);
         break;
     case 0x2000:
-        Opcode_2NNN(opcode);
+        ins.handler = HANDLER(Opcode_2NNN);
         break;
     case 0x3000:
-        Opcode_3XNN(opcode);
+        ins.handler = HANDLER(Opcode_3XNN);
         break;
     case 0x4000:
-        Opcode_4XNN(opcode);
+        ins.handler = HANDLER(Opcode_4XNN);
         break;
     case 0x5000:
-        Opcode_5XY0(opcode);
+        switch (opcode & 0x000F)
+        {
+        case 0x0002:
+            ins.handler = HANDLER(Opcode_5XY2);
+            break;
+        case 0x0003:
+            ins.handler = HANDLER(Opcode_5XY3);
+            break;
+        default:
+            ins.handler = HANDLER(Opcode_5XY0);
+            break;
+        }
         break;
     case 0x6000:
-        Opcode_6XNN(opcode);
+        ins.handler = HANDLER(Opcode_6XNN);
         break;
     case 0x7000:
-        Opcode_7XNN(opcode);
+        ins.handler = HANDLER(Opcode_7XNN);
         break;
     case 0x8000:
         switch (opcode & 0x000F)
         {
         case 0x0000:
-            Opcode_8XY0(opcode);
+            ins.handler = HANDLER(Opcode_8XY0);
             break;
         case 0x0001:
-            Opcode_8XY1(opcode);
+            ins.handler = HANDLER(Opcode_8XY1<Q>);
             break;
         case 0x0002:
-            Opcode_8XY2(opcode);
+            ins.handler = HANDLER(Opcode_8XY2<Q>);
             break;
         case 0x0003:
-            Opcode_8XY3(opcode);
+            ins.handler = HANDLER(Opcode_8XY3<Q>);
             break;
         case 0x0004:
-            Opcode_8XY4(opcode);
+            ins.handler = HANDLER(Opcode_8XY4);
             break;
         case 0x0005:
-            Opcode_8XY5(opcode);
+            ins.handler = HANDLER(Opcode_8XY5);
             break;
         case 0x0006:
-            Opcode_8XY6(opcode);
+            ins.handler = HANDLER(Opcode_8XY6<Q>);
             break;
         case 0x0007:
-            Opcode_8XY7(opcode);
+            ins.handler = HANDLER(Opcode_8XY7);
             break;
         case 0x000E:
-            Opcode_8XYE(opcode);
+            ins.handler = HANDLER(Opcode_8XYE<Q>);
             break;
         }
         break;
     case 0x9000:
-        Opcode_9XY0(opcode);
+        ins.handler = HANDLER(Opcode_9XY0);
         break;
     case 0xA000:
-        Opcode_ANNN(opcode);
+        ins.handler = HANDLER(Opcode_ANNN);
         break;
     case 0xB000:
-        Opcode_BNNN(opcode);
+        ins.handler = HANDLER(Opcode_BNNN<Q>);
         break;
     case 0xC000:
-        Opcode_CXNN(opcode);
+        ins.handler = HANDLER(Opcode_CXNN);
         break;
     case 0xD000:
-        Opcode_DXYN(opcode);
+        if ((opcode & 0x000F) == 0)
+            ins.handler = HANDLER(Opcode_DXY0<Q>);
+        else
+            ins.handler = HANDLER(Opcode_DXYN<Q>);
         break;
     case 0xE000:
         switch (opcode & 0x000F)
         {
         case 0x000E:
-            Opcode_EX9E(opcode);
+            ins.handler = HANDLER(Opcode_EX9E);
             break;
         case 0x0001:
-            Opcode_EXA1(opcode);
+            ins.handler = HANDLER(Opcode_EXA1);
             break;
         }
         break;
     case 0xF000:
         switch (opcode & 0x000F)
         {
+        case 0x0000:
+            if ((opcode & 0x00F0) == 0x0030)
+                ins.handler = HANDLER(Opcode_FX30);
+            break;
+        case 0x0001:
+            if ((opcode & 0x00F0) == 0x0000)
+                ins.handler = HANDLER(Opcode_FN01);
+            break;
         case 0x0007:
-            Opcode_FX07(opcode);
+            ins.handler = HANDLER(Opcode_FX07);
             break;
         case 0x00A:
-            Opcode_FX0A(opcode);
+            ins.handler = HANDLER(Opcode_FX0A);
             break;
         case 0x0008:
-            Opcode_FX18(opcode);
+            ins.handler = HANDLER(Opcode_FX18);
             break;
         case 0x000E:
-            Opcode_FX1E(opcode);
+            ins.handler = HANDLER(Opcode_FX1E);
             break;
         case 0x0009:
-            Opcode_FX29(opcode);
+            ins.handler = HANDLER(Opcode_FX29);
             break;
         case 0x0003:
-            Opcode_FX33(opcode);
+            ins.handler = HANDLER(Opcode_FX33);
             break;
         case 0x0005:
             switch (opcode & 0x00F0)
             {
             case 0x0010:
-                Opcode_FX15(opcode);
+                ins.handler = HANDLER(Opcode_FX15);
                 break;
             case 0x0050:
-                Opcode_FX55(opcode);
+                ins.handler = HANDLER(Opcode_FX55<Q>);
                 break;
             case 0x0060:
-                Opcode_FX65(opcode);
+                ins.handler = HANDLER(Opcode_FX65<Q>);
+                break;
+            case 0x0070:
+                ins.handler = HANDLER(Opcode_FX75);
+                break;
+            case 0x0080:
+                ins.handler = HANDLER(Opcode_FX85);
                 break;
             }
             break;
@@ -199,321 +665,592 @@ void Chip8::DecodeOpcode(uint16_t opcode)
     default: // opcode not found
         break;
     }
+    return ins;
+}
+
+const char *Chip8::OpcodeName(uint16_t opcode)
+{
+    static const struct
+    {
+        Handler handler;
+        const char *name;
+    } names[] = {
+        {HANDLER(Opcode_00E0), "00E0"},
+        {HANDLER(Opcode_00EE), "00EE"},
+        {HANDLER(Opcode_00CN), "00CN"},
+        {HANDLER(Opcode_00DN), "00DN"},
+        {HANDLER(Opcode_00FB), "00FB"},
+        {HANDLER(Opcode_00FC), "00FC"},
+        {HANDLER(Opcode_00FD), "00FD"},
+        {HANDLER(Opcode_00FE), "00FE"},
+        {HANDLER(Opcode_00FF), "00FF"},
+        {HANDLER(Opcode_1NNN), "1NNN"},
+        {HANDLER(Opcode_2NNN), "2NNN"},
+        {HANDLER(Opcode_3XNN), "3XNN"},
+        {HANDLER(Opcode_4XNN), "4XNN"},
+        {HANDLER(Opcode_5XY0), "5XY0"},
+        {HANDLER(Opcode_5XY2), "5XY2"},
+        {HANDLER(Opcode_5XY3), "5XY3"},
+        {HANDLER(Opcode_6XNN), "6XNN"},
+        {HANDLER(Opcode_7XNN), "7XNN"},
+        {HANDLER(Opcode_8XY0), "8XY0"},
+        {HANDLER(Opcode_8XY1<QUIRKS_DEFAULT>), "8XY1"},
+        {HANDLER(Opcode_8XY2<QUIRKS_DEFAULT>), "8XY2"},
+        {HANDLER(Opcode_8XY3<QUIRKS_DEFAULT>), "8XY3"},
+        {HANDLER(Opcode_8XY4), "8XY4"},
+        {HANDLER(Opcode_8XY5), "8XY5"},
+        {HANDLER(Opcode_8XY6<QUIRKS_DEFAULT>), "8XY6"},
+        {HANDLER(Opcode_8XY7), "8XY7"},
+        {HANDLER(Opcode_8XYE<QUIRKS_DEFAULT>), "8XYE"},
+        {HANDLER(Opcode_9XY0), "9XY0"},
+        {HANDLER(Opcode_ANNN), "ANNN"},
+        {HANDLER(Opcode_BNNN<QUIRKS_DEFAULT>), "BNNN"},
+        {HANDLER(Opcode_CXNN), "CXNN"},
+        {HANDLER(Opcode_DXYN<QUIRKS_DEFAULT>), "DXYN"},
+        {HANDLER(Opcode_DXY0<QUIRKS_DEFAULT>), "DXY0"},
+        {HANDLER(Opcode_EX9E), "EX9E"},
+        {HANDLER(Opcode_EXA1), "EXA1"},
+        {HANDLER(Opcode_FX07), "FX07"},
+        {HANDLER(Opcode_FX0A), "FX0A"},
+        {HANDLER(Opcode_FX15), "FX15"},
+        {HANDLER(Opcode_FX18), "FX18"},
+        {HANDLER(Opcode_FX1E), "FX1E"},
+        {HANDLER(Opcode_FN01), "FN01"},
+        {HANDLER(Opcode_FX29), "FX29"},
+        {HANDLER(Opcode_FX30), "FX30"},
+        {HANDLER(Opcode_FX33), "FX33"},
+        {HANDLER(Opcode_FX55<QUIRKS_DEFAULT>), "FX55"},
+        {HANDLER(Opcode_FX65<QUIRKS_DEFAULT>), "FX65"},
+        {HANDLER(Opcode_FX75), "FX75"},
+        {HANDLER(Opcode_FX85), "FX85"},
+    };
+
+    Handler handler = Decode(opcode).handler;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (names[i].handler == handler)
+            return names[i].name;
+    }
+    return "NONE";
 }
 
-void Chip8::Opcode_1NNN(uint16_t opcode)
+#undef HANDLER
+
+void Chip8::Opcode_1NNN(const Instruction &ins)
 {
-    programCounter = opcode & 0x0FFF; // get the back 3 values of the opcode (address)
+    // jump to itself, or back to the top of a delay timer poll, spins until the frame ends
+    if (ins.nnn == programCounter - 2)
+        idleLoop = 1;
+    else if (ins.nnn == programCounter - 6 && TimerPoll(ins.nnn))
+        idleLoop = 3;
+
+    programCounter = ins.nnn; // get the back 3 values of the opcode (address)
 }
 
-void Chip8::Opcode_00E0(uint16_t opcode)
+void Chip8::Opcode_00E0(const Instruction &)
 {
-    memset(video, 0, sizeof(video)); // reset video
+    // reset video, only the selected planes
+    for (int plane = 0; plane < PLANES; plane++)
+    {
+        if (planes & (1 << plane))
+            memset(video[plane], 0, sizeof(video[plane]));
+    }
+    MarkDirty(0, 63);
 }
 
-void Chip8::Opcode_00EE(uint16_t opcode)
+// scroll kernels, a whole 128-pixel row (two words) at a time, never a pixel at a time
+// sideways scrolls carry the bits that cross from one half of a row into the other
+
+static void ScrollRows(uint64_t (*rows)[2], int height, int down)
 {
-    programCounter = stack.back(); // return to previous address
-    stack.pop_back();              // finished
+    // down > 0 moves rows down, down < 0 up, rows scrolled in are blank
+    if (down > 0)
+    {
+        memmove(rows[down], rows[0], (height - down) * sizeof(rows[0]));
+        memset(rows[0], 0, down * sizeof(rows[0]));
+    }
+    else if (down < 0)
+    {
+        memmove(rows[0], rows[-down], (height + down) * sizeof(rows[0]));
+        memset(rows[height + down], 0, -down * sizeof(rows[0]));
+    }
 }
 
-void Chip8::Opcode_2NNN(uint16_t opcode)
+static void ScrollRight4(uint64_t (*rows)[2], int height)
 {
-    stack.push_back(programCounter);  // save program counter
-    programCounter = opcode & 0x0FFF; // goto next address
+    int i = 0;
+#ifdef __AVX2__
+    // two rows per register, the carry moves from half 0 to half 1 inside each 128-bit lane
+    for (; i + 2 <= height; i += 2)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)rows[i]);
+        __m256i carry = _mm256_bslli_epi128(_mm256_slli_epi64(v, 60), 8);
+        _mm256_storeu_si256((__m256i *)rows[i], _mm256_or_si256(_mm256_srli_epi64(v, 4), carry));
+    }
+#endif
+    for (; i < height; i++)
+    {
+        rows[i][1] = (rows[i][1] >> 4) | (rows[i][0] << 60);
+        rows[i][0] >>= 4;
+    }
+}
+
+static void ScrollLeft4(uint64_t (*rows)[2], int height)
+{
+    int i = 0;
+#ifdef __AVX2__
+    // same as ScrollRight4 with the carry going from half 1 back to half 0
+    for (; i + 2 <= height; i += 2)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)rows[i]);
+        __m256i carry = _mm256_bsrli_epi128(_mm256_srli_epi64(v, 60), 8);
+        _mm256_storeu_si256((__m256i *)rows[i], _mm256_or_si256(_mm256_slli_epi64(v, 4), carry));
+    }
+#endif
+    for (; i < height; i++)
+    {
+        rows[i][0] = (rows[i][0] << 4) | (rows[i][1] >> 60);
+        rows[i][1] <<= 4;
+    }
+}
+
+// scrolls move whole pixels of the current mode, low-res scrolls stay inside its 64x32
+void Chip8::Opcode_00CN(const Instruction &ins)
+{
+    for (int plane = 0; plane < PLANES; plane++)
+    {
+        if (planes & (1 << plane))
+            ScrollRows(video[plane], Height(), ins.n);
+    }
+    MarkDirty(0, Height() - 1);
+}
+
+void Chip8::Opcode_00DN(const Instruction &ins)
+{
+    for (int plane = 0; plane < PLANES; plane++)
+    {
+        if (planes & (1 << plane))
+            ScrollRows(video[plane], Height(), -ins.n);
+    }
+    MarkDirty(0, Height() - 1);
+}
+
+void Chip8::Opcode_00FB(const Instruction &)
+{
+    for (int plane = 0; plane < PLANES; plane++)
+    {
+        if (!(planes & (1 << plane)))
+            continue;
+        ScrollRight4(video[plane], Height());
+        if (!hires)
+        {
+            // whatever went past pixel 63 is off the low-res screen
+            for (int row = 0; row < 32; row++)
+                video[plane][row][1] = 0;
+        }
+    }
+    MarkDirty(0, Height() - 1);
+}
+
+void Chip8::Opcode_00FC(const Instruction &)
+{
+    for (int plane = 0; plane < PLANES; plane++)
+    {
+        if (planes & (1 << plane))
+            ScrollLeft4(video[plane], Height());
+    }
+    MarkDirty(0, Height() - 1);
+}
+
+void Chip8::Opcode_00FD(const Instruction &)
+{
+    Halt(FAULT_EXIT);
+}
+
+void Chip8::Opcode_00FE(const Instruction &)
+{
+    hires = 0;
+    memset(video, 0, sizeof(video)); // the old picture doesn't fit the new mode
+    MarkDirty(0, 63);
+}
+
+void Chip8::Opcode_00FF(const Instruction &)
+{
+    hires = 1;
+    memset(video, 0, sizeof(video));
+    MarkDirty(0, 63);
+}
+
+void Chip8::Opcode_00EE(const Instruction &)
+{
+    if (stackSize == 0)
+    {
+        Halt(FAULT_STACK_UNDERFLOW);
+        return;
+    }
+    programCounter = stack[--stackSize]; // return to previous address
+}
+
+void Chip8::Opcode_2NNN(const Instruction &ins)
+{
+    if (stackSize == 16)
+    {
+        Halt(FAULT_STACK_OVERFLOW);
+        return;
+    }
+    stack[stackSize++] = programCounter; // save program counter
+    programCounter = ins.nnn;            // goto next address
+    CHIP8_STAT(stats.stackHighWater = std::max<uint64_t>(stats.stackHighWater, stackSize));
 }
 
-void Chip8::Opcode_3XNN(uint16_t opcode)
+void Chip8::Opcode_3XNN(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int byte = opcode & 0x00FF;
-    if (registers[regx] == byte)
+    if (registers[ins.x] == ins.nn)
     {
         programCounter += 2; // skip next instruction
+        CHIP8_STAT(stats.skips++);
     }
 }
 
-void Chip8::Opcode_4XNN(uint16_t opcode)
+void Chip8::Opcode_4XNN(const Instruction &ins)
 {
     // basically the same as 3XNN
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int byte = opcode & 0x00FF;
-    if (registers[regx] != byte)
+    if (registers[ins.x] != ins.nn)
     {
         programCounter += 2; // skip next instruction
+        CHIP8_STAT(stats.skips++);
     }
 }
 
-void Chip8::Opcode_5XY0(uint16_t opcode)
+void Chip8::Opcode_5XY0(const Instruction &ins)
 {
-    // get the values in the registers
-    int regx = opcode & 0x0F00;
-    regx >>= 8; // shift x over 8 bits
-    int regy = opcode & 0x00F0;
-    regy >>= 4; // shift y over 4 bits
-    if (registers[regx] == registers[regy])
+    if (registers[ins.x] == registers[ins.y])
     {
         programCounter += 2; // skip next instruction
+        CHIP8_STAT(stats.skips++);
+    }
+}
+
+void Chip8::Opcode_5XY2(const Instruction &ins)
+{
+    // VX first, counting down if Y comes before X
+    int count = abs(ins.x - ins.y) + 1;
+    int step = ins.x <= ins.y ? 1 : -1;
+    for (int i = 0; i < count; i++)
+    {
+        memory[(indexRegister + i) & 0xFFF] = registers[ins.x + i * step];
+    }
+
+    // the ROM may be rewriting its own code
+    InvalidateCode(indexRegister, count);
+}
+
+void Chip8::Opcode_5XY3(const Instruction &ins)
+{
+    int count = abs(ins.x - ins.y) + 1;
+    int step = ins.x <= ins.y ? 1 : -1;
+    for (int i = 0; i < count; i++)
+    {
+        registers[ins.x + i * step] = memory[(indexRegister + i) & 0xFFF];
     }
 }
 
-void Chip8::Opcode_6XNN(uint16_t opcode)
+void Chip8::Opcode_6XNN(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int byte = opcode & 0x00FF;
-    registers[regx] = byte;
+    registers[ins.x] = ins.nn;
 }
 
-void Chip8::Opcode_7XNN(uint16_t opcode)
+void Chip8::Opcode_7XNN(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int byte = opcode & 0x00FF;
-    registers[regx] += byte;
+    registers[ins.x] += ins.nn;
 }
 
-void Chip8::Opcode_8XY0(uint16_t opcode)
+void Chip8::Opcode_8XY0(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-    registers[regx] = registers[regy];
+    registers[ins.x] = registers[ins.y];
 }
 
-void Chip8::Opcode_8XY1(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_8XY1(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-    registers[regx] |= registers[regy];
+    registers[ins.x] |= registers[ins.y];
+    if (Q.logicResetsVF)
+        registers[0xF] = 0;
 }
 
-void Chip8::Opcode_8XY2(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_8XY2(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-    registers[regx] &= registers[regy];
+    registers[ins.x] &= registers[ins.y];
+    if (Q.logicResetsVF)
+        registers[0xF] = 0;
 }
-void Chip8::Opcode_8XY3(uint16_t opcode)
+
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_8XY3(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-    registers[regx] ^= registers[regy];
+    registers[ins.x] ^= registers[ins.y];
+    if (Q.logicResetsVF)
+        registers[0xF] = 0;
 }
-void Chip8::Opcode_8XY4(uint16_t opcode)
+void Chip8::Opcode_8XY4(const Instruction &ins)
 {
-    registers[0xF] = 0;
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-    registers[regx] += registers[regy];
-    if (registers[regx] + registers[regy] > 255)
-        registers[0xF] = 1;
+    // check for overflow before the add overwrites VX
+    int sum = registers[ins.x] + registers[ins.y];
+    registers[ins.x] = sum;
+    registers[0xF] = sum > 255;
 }
 
-void Chip8::Opcode_8XY5(uint16_t opcode)
+void Chip8::Opcode_8XY5(const Instruction &ins)
 {
     // get the values in the registers
-    registers[0xF] = 1;
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-    int valueX = registers[regx];
-    int valueY = registers[regy];
-    // check if there will be underflow, store result in VF
-    if (valueY > valueX)
-        registers[0xF] = 0;
+    int valueX = registers[ins.x];
+    int valueY = registers[ins.y];
     // perform subtraction
-    registers[regx] -= registers[regy];
+    registers[ins.x] = valueX - valueY;
+    // check if there was underflow, store result in VF
+    registers[0xF] = valueY > valueX ? 0 : 1;
 }
 
-void Chip8::Opcode_8XY6(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_8XY6(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    registers[0xF] = registers[regx] & 0x1;
-    registers[regx] >>= 1;
+    uint8_t value = registers[Q.shiftVY ? ins.y : ins.x];
+    registers[ins.x] = value >> 1;
+    registers[0xF] = value & 0x1;
 }
 
-void Chip8::Opcode_8XY7(uint16_t opcode)
+void Chip8::Opcode_8XY7(const Instruction &ins)
 {
-    registers[0xF] = 1;
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-    if (registers[regx] > registers[regy]) // check for underflow
-        registers[0xF] = 0;
-    registers[regx] = registers[regy] - registers[regx];
+    int valueX = registers[ins.x];
+    int valueY = registers[ins.y];
+    registers[ins.x] = valueY - valueX;
+    registers[0xF] = valueX > valueY ? 0 : 1; // check for underflow
 }
 
-void Chip8::Opcode_8XYE(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_8XYE(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    registers[0xF] = (registers[regx] & 0x80) >> 7;
-    registers[regx] <<= 1;
+    uint8_t value = registers[Q.shiftVY ? ins.y : ins.x];
+    registers[ins.x] = value << 1;
+    registers[0xF] = (value & 0x80) >> 7;
 }
 
-void Chip8::Opcode_9XY0(uint16_t opcode)
+void Chip8::Opcode_9XY0(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-    if (registers[regx] != registers[regy])
+    if (registers[ins.x] != registers[ins.y])
     {
         programCounter += 2;
+        CHIP8_STAT(stats.skips++);
     }
 }
-void Chip8::Opcode_ANNN(uint16_t opcode)
+void Chip8::Opcode_ANNN(const Instruction &ins)
 {
-    indexRegister = opcode & 0x0FFF;
+    indexRegister = ins.nnn;
 }
 
-void Chip8::Opcode_BNNN(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_BNNN(const Instruction &ins)
 {
-    programCounter = registers[0] + (opcode & 0x0FFF);
+    programCounter = registers[Q.jumpVX ? ins.x : 0] + ins.nnn;
 }
 
-void Chip8::Opcode_CXNN(uint16_t opcode)
+void Chip8::Opcode_CXNN(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-
     // get random number 0 to 255
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<uint8_t> distrib(0, 255u);
-    uint8_t randomByte = distrib(gen);
+    registers[ins.x] = Random() & ins.nn;
+}
+
+template <const Chip8Quirks &Q>
+void Chip8::Draw(const Instruction &ins, int height, bool wide)
+{
+    // same as DXYN below for any mode and planes, a sprite row is 8 or 16 pixels wide
+    // and lands in at most two row words
+    int startX = registers[ins.x] & (Width() - 1); // the start position wraps around the screen
+    int startY = registers[ins.y] & (Height() - 1);
+    int rowMask = Height() - 1;
+    int rows = Q.wrapSprites ? height : std::min(height, Height() - startY); // past the bottom edge is clipped
+    int bytes = wide ? 2 : 1;
+    int shift = startX & 63;
 
-    registers[regx] = randomByte & (opcode & 0x00FF);
+    // with two planes selected the second plane's sprite follows the first in memory
+    uint64_t collision = 0;
+    bool drawn = false;
+    uint16_t address = indexRegister;
+    for (int plane = 0; plane < PLANES; plane++, address += height * bytes)
+    {
+        if (!(planes & (1 << plane)))
+            continue;
+        for (int row = 0; row < rows; row++)
+        {
+            uint16_t at = address + row * bytes;
+            uint64_t bits = (uint64_t)memory[at & 0xFFF] << 56;
+            if (wide)
+                bits |= (uint64_t)memory[(at + 1) & 0xFFF] << 48;
+
+            // the sprite starts in one word, whatever runs past that word's end carries on in the
+            // next one, or past the right edge of the screen, where it is clipped or wraps round
+            uint64_t first = bits >> shift;
+            uint64_t carry = shift == 0 ? 0 : bits << (64 - shift);
+            uint64_t left, right;
+            if (!hires)
+            {
+                left = first | (Q.wrapSprites ? carry : 0);
+                right = 0;
+            }
+            else if (startX < 64)
+            {
+                left = first;
+                right = carry;
+            }
+            else
+            {
+                left = Q.wrapSprites ? carry : 0;
+                right = first;
+            }
+
+            uint64_t *line = video[plane][(startY + row) & rowMask];
+            collision |= (line[0] & left) | (line[1] & right); // pixel IS being flipped off
+            line[0] ^= left;                                  // flip the whole row at once
+            line[1] ^= right;
+            drawn |= (left | right) != 0;
+            CHIP8_STAT(stats.pixels += __builtin_popcountll(left) + __builtin_popcountll(right));
+        }
+    }
+    registers[0xF] = collision != 0;
+    CHIP8_STAT(stats.draws++; stats.collisions += collision != 0);
+    if (!drawn)
+        return;
+    if (startY + rows > Height())
+        MarkDirty(0, Height() - 1); // wrapped round to the top
+    else
+        MarkDirty(startY, startY + rows - 1);
 }
 
-void Chip8::Opcode_DXYN(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_DXYN(const Instruction &ins)
 {
+    if (hires || planes != 1)
+    {
+        Draw<Q>(ins, ins.n, false);
+        return;
+    }
+
     // draw N pixels tall sprite from memory location held in index
     // at horizontal coordinate VX and vertical coordinate VY
     // on pixels will flip what is already on the screen , from left to right and MSB to LSB
     // VF = 1 if any pixels were turned off by this
-    // a sprite is 8 pixels wide
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int regy = opcode & 0x00F0;
-    regy >>= 4;
-
-    int startX = registers[regx];
-    int startY = registers[regy];
-    int height = opcode & 0x000F;
-
-    registers[0xF] = 0;
+    // plain CHIP-8 (low-res, first plane only) is most draws, a sprite byte lines up with one row word
+    int startX = registers[ins.x] & 63; // the start position wraps around the screen
+    int startY = registers[ins.y] & 31;
+    int height = ins.n;
 
-    for (int row = 0; row < height; row++)
+    // whatever goes past the right or bottom edge is clipped, or wraps round with wrapSprites
+    uint64_t collision = 0;
+    int top = 32, bottom = -1; // rows that actually changed
+    for (int row = 0; row < height && (Q.wrapSprites || startY + row < 32); row++)
     {
-        uint8_t spriteData = memory[indexRegister + row];
-        for (int col = 0; col < 8; col++)
-        { // always 8 columns (sprite is 8 pixels wide)
-            if ((spriteData & (0x80 >> col)) != 0)
-            {
-                int x = startX + col;
-                int y = startY + row;
-                if (video[x][y] == 1) // pixel IS being flipped off
-                    registers[0xF] = 1;
-                video[x][y] ^= 1; // flip pixel
-            }
+        int y = (startY + row) & 31;
+        uint64_t bits = (uint64_t)memory[(indexRegister + row) & 0xFFF] << 56;
+        uint64_t sprite = bits >> startX;
+        if (Q.wrapSprites && startX != 0)
+            sprite |= bits << (64 - startX);
+        collision |= video[0][y][0] & sprite; // pixel IS being flipped off
+        video[0][y][0] ^= sprite;             // flip the whole row at once
+        CHIP8_STAT(stats.pixels += __builtin_popcountll(sprite));
+        if (sprite != 0)
+        {
+            if (top > y)
+                top = y;
+            if (bottom < y)
+                bottom = y;
         }
     }
+    registers[0xF] = collision != 0;
+    CHIP8_STAT(stats.draws++; stats.collisions += collision != 0);
+    if (bottom >= 0)
+        MarkDirty(top, bottom);
 }
 
-void Chip8::Opcode_EX9E(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_DXY0(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    if (inputKeys[registers[regx]]) // check if input key stored in VX is pressed
+    Draw<Q>(ins, 16, true);
+}
+
+void Chip8::Opcode_EX9E(const Instruction &ins)
+{
+    if (inputKeys[registers[ins.x] & 0xF]) // check if input key stored in VX is pressed
     {
         programCounter += 2;
+        CHIP8_STAT(stats.skips++);
     }
 }
 
-void Chip8::Opcode_EXA1(uint16_t opcode)
+void Chip8::Opcode_EXA1(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    if (!inputKeys[registers[regx]]) // check if input key stored in VX is NOT pressed
+    if (!inputKeys[registers[ins.x] & 0xF]) // check if input key stored in VX is NOT pressed
     {
         programCounter += 2;
+        CHIP8_STAT(stats.skips++);
     }
 }
 
-void Chip8::Opcode_FX07(uint16_t opcode)
+void Chip8::Opcode_FX07(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    registers[regx] = delayTimer;
+    registers[ins.x] = delayTimer;
 }
 
-void Chip8::Opcode_FX0A(uint16_t opcode)
+void Chip8::Opcode_FX0A(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
     for (int i = 0; i < 16; i++)
     {
         if (inputKeys[i])
         {
-            registers[regx] = i; // store key in VX
+            registers[ins.x] = i; // store key in VX
             return;
         }
     }
     // if no key pressed, decrement program counter
     programCounter -= 2;
+    idleLoop = 1;
 }
 
-void Chip8::Opcode_FX15(uint16_t opcode)
+void Chip8::Opcode_FX15(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    delayTimer = registers[regx];
+    delayTimer = registers[ins.x];
 }
 
-void Chip8::Opcode_FX18(uint16_t opcode)
+void Chip8::Opcode_FX18(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    soundTimer = registers[regx];
+    soundTimer = registers[ins.x];
 }
 
-void Chip8::Opcode_FX1E(uint16_t opcode)
+void Chip8::Opcode_FX1E(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    indexRegister += registers[regx];
+    indexRegister += registers[ins.x];
 }
 
-void Chip8::Opcode_FX29(uint16_t opcode)
+void Chip8::Opcode_FX29(const Instruction &ins)
 {
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int valueX = registers[regx];
+    int valueX = registers[ins.x];
     indexRegister = 0x50 + (valueX * 5);
 }
 
-void Chip8::Opcode_FX33(uint16_t opcode)
+void Chip8::Opcode_FN01(const Instruction &ins)
+{
+    planes = ins.x & 3;
+}
+
+void Chip8::Opcode_FX30(const Instruction &ins)
+{
+    indexRegister = 0xA0 + (registers[ins.x] & 0xF) * 10;
+}
+
+void Chip8::Opcode_FX33(const Instruction &ins)
 {
     // get the value in the register
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
-    int value = registers[regx];
+    int value = registers[ins.x];
 
     // get each digit of the register separately
     int hundreds = value / 100;
@@ -521,29 +1258,66 @@ void Chip8::Opcode_FX33(uint16_t opcode)
     int ones = value % 10;
 
     // store in desired location
-    memory[indexRegister] = hundreds;
-    memory[indexRegister + 1] = tens;
-    memory[indexRegister + 2] = ones;
+    memory[indexRegister & 0xFFF] = hundreds;
+    memory[(indexRegister + 1) & 0xFFF] = tens;
+    memory[(indexRegister + 2) & 0xFFF] = ones;
+
+    // the ROM may be rewriting its own code
+    InvalidateCode(indexRegister, 3);
 }
 
-void Chip8::Opcode_FX55(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_FX55(const Instruction &ins)
 {
     // get final register
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
+    int regx = ins.x;
     for (int i = 0; i <= regx; i++)
     {
-        memory[indexRegister + i] = registers[i];
+        memory[(indexRegister + i) & 0xFFF] = registers[i];
     }
+
+    // the ROM may be rewriting its own code
+    InvalidateCode(indexRegister, regx + 1);
+    if (Q.memoryI != 0)
+        indexRegister += regx + (Q.memoryI == 2);
 }
 
-void Chip8::Opcode_FX65(uint16_t opcode)
+template <const Chip8Quirks &Q>
+void Chip8::Opcode_FX65(const Instruction &ins)
 {
     // get final register
-    int regx = opcode & 0x0F00;
-    regx >>= 8;
+    int regx = ins.x;
     for (int i = 0; i <= regx; i++)
     {
-        registers[i] = memory[indexRegister + i];
+        registers[i] = memory[(indexRegister + i) & 0xFFF];
     }
-}
\ No newline at end of file
+    if (Q.memoryI != 0)
+        indexRegister += regx + (Q.memoryI == 2);
+}
+
+void Chip8::Opcode_FX75(const Instruction &ins)
+{
+    for (int i = 0; i <= ins.x; i++)
+    {
+        flags[i] = registers[i];
+    }
+}
+
+void Chip8::Opcode_FX85(const Instruction &ins)
+{
+    for (int i = 0; i <= ins.x; i++)
+    {
+        registers[i] = flags[i];
+    }
+}
+
+void Chip8::Opcode_NONE(const Instruction &)
+{
+}
+
+// lockstep.cxx tells the default profile's handlers apart by address, so they have to exist out of line
+template void Chip8::Opcode_8XY1<QUIRKS_DEFAULT>(const Instruction &);
+template void Chip8::Opcode_8XY2<QUIRKS_DEFAULT>(const Instruction &);
+template void Chip8::Opcode_8XY3<QUIRKS_DEFAULT>(const Instruction &);
+template void Chip8::Opcode_8XY6<QUIRKS_DEFAULT>(const Instruction &);
+template void Chip8::Opcode_8XYE<QUIRKS_DEFAULT>(const Instruction &);
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <string.h>
 #include <vector>
 #include <stdio.h>
@@ -8,69 +10,280 @@
 #include <chrono>
 #include <thread>
 #include <stdint.h>
-#include <windows.h>
+#include <type_traits>
+
+// instrumentation is opt in, build with -DCHIP8_STATS to count what runs
+#ifdef CHIP8_STATS
+#include "stats.h"
+#define CHIP8_STAT(statement) statement
+#else
+#define CHIP8_STAT(statement)
+#endif
+
+class Chip8Jit;
+class Chip8Aot;
+class Chip8Trace;
+struct Chip8Rom;
 
-class Chip8
+// how a ROM expects the opcodes CHIP-8 interpreters never agreed on to behave
+struct Chip8Quirks
 {
-public:
-    const unsigned int START_ADDRESS = 0x200; // game is loaded at this address
+    const char *name;
+    bool logicResetsVF; // 8XY1 / 8XY2 / 8XY3 clear VF
+    bool shiftVY;       // 8XY6 / 8XYE shift VY into VX instead of shifting VX in place
+    uint8_t memoryI;    // what FX55 / FX65 do to I: 0 leave it, 1 add X, 2 add X + 1
+    bool jumpVX;        // BNNN is BXNN, jumps to XNN + VX instead of NNN + V0
+    bool wrapSprites;   // DXYN wraps sprites round the screen edges instead of clipping them
+};
+
+// the profiles, handlers that care take one as a template parameter so every profile gets
+// its own copy of them with the choices folded in, Decode picks the copies once per address
+inline constexpr Chip8Quirks QUIRKS_DEFAULT = {"default", false, false, 0, false, false}; // what this emulator always did
+inline constexpr Chip8Quirks QUIRKS_VIP = {"vip", true, true, 2, false, false};           // COSMAC VIP
+inline constexpr Chip8Quirks QUIRKS_CHIP48 = {"chip48", false, false, 1, true, false};    // HP48 CHIP-48
+inline constexpr Chip8Quirks QUIRKS_SCHIP = {"schip", false, false, 0, true, false};      // SUPER-CHIP 1.1
+inline constexpr Chip8Quirks QUIRKS_XOCHIP = {"xochip", false, true, 2, false, true};     // XO-CHIP
+
+// everything a running ROM can observe, and nothing else
+// plain data with a fixed layout: copying a machine, saving it or resetting it is one
+// memcpy, no heap memory anywhere, 6272 bytes (98 cache lines) per machine so a few
+// hundred thousand fit in a couple of GB, the decode cache lives in Chip8 and is not part of it
+struct alignas(64) Chip8State
+{
+    static const unsigned int START_ADDRESS = 0x200; // game is loaded at this address
+
+    enum Fault
+    {
+        FAULT_NONE,
+        FAULT_STACK_OVERFLOW,  // 2NNN with 16 calls already nested
+        FAULT_STACK_UNDERFLOW, // 00EE with nothing to return to
+        FAULT_EXIT,            // 00FD, the ROM asked to stop
+    };
+
+    static const int PLANES = 2; // XO-CHIP draws on two bitplanes, plain CHIP-8 and SUPER-CHIP only use the first
+
+    uint8_t memory[4096]; // 4096 bytes of memory, address space from 0x000 to 0xFFF
+    // pixel display, [plane][row][half], one 128-pixel row per two words, bit 63 of half 0 is
+    // the leftmost pixel, low-res uses the top left 64x32 (rows 0 to 31, half 0) and keeps the rest clear
+    uint64_t video[PLANES][64][2];
+    uint64_t randomState; // CXNN random number generator
+
+    uint16_t stack[16]; // hold 16 PCs, the first stackSize are in use
 
-    uint8_t registers[16];   // 16 8-bit registers, labeled V0 to VF, hold values 0x00 to 0xFF
-    uint8_t memory[4096];    // 4096 bytes of memory, address space from 0x000 to 0xFFF
     uint16_t indexRegister;  // 16-bit register, store memory addresses for use in operations, also known as I
     uint16_t programCounter; // 16-bit register, store address of next instruction to execute
+    uint16_t opcode;         // next instruction
 
-    std::vector<uint16_t> stack; // hold 16 PCs
+    uint8_t registers[16]; // 16 8-bit registers, labeled V0 to VF, hold values 0x00 to 0xFF
+    uint8_t inputKeys[16]; // 16 input keys corresponding to 0-F
 
-    // decrement timers 60 times per second (60 Hz)
+    // decrement timers 60 times per second (60 Hz), once per frame
     uint8_t delayTimer;
     uint8_t soundTimer;
 
-    uint8_t inputKeys[16]; // 16 input keys corresponding to 0-F
+    uint8_t stackSize;
+    uint8_t fault; // set when the ROM broke the stack or exited, the machine stops on that instruction
 
-    uint16_t opcode; // next instruction
+    uint8_t flags[16]; // SUPER-CHIP RPL user flags, FX75 / FX85
+    uint8_t hires;     // 128x64 after 00FF, 64x32 after 00FE and at power on
+    uint8_t planes;    // bitplanes DXYN, scrolls and 00E0 work on, FN01, 1 at power on
 
-    uint32_t video[64][32]; // pixel display
+    uint8_t reserved[28]; // rounds up to whole cache lines without compiler padding
+};
 
-    void ResetCPU(char *filename); // initialize CPU
+class Chip8 : public Chip8State
+{
+public:
+    // instruction decoded once, operands already pulled out of the opcode
+    struct Instruction;
+    typedef void (*Handler)(Chip8 &, const Instruction &);
+    struct Instruction
+    {
+        Handler handler; // NULL until the address is decoded
+        uint16_t opcode; // raw instruction
+        uint16_t nnn;    // address, lowest 12 bits
+        uint8_t x;       // register X, second digit
+        uint8_t y;       // register Y, third digit
+        uint8_t nn;      // byte, lowest 8 bits
+        uint8_t n;       // nibble, lowest 4 bits
+        uint8_t length;  // instructions the handler runs at most, 2 or 3 for a fused sequence
+    };
+
+    int instructionsPerFrame = 11; // CPU speed, instructions per 60 Hz frame (about 660 Hz)
+
+    // opcode behaviour profile, change it with SetQuirks so decoded code is thrown away
+    const Chip8Quirks *quirks = &QUIRKS_DEFAULT;
+
+    // CXNN random numbers, xorshift64* seeded from seed on every reset so a run
+    // with the same seed and the same input is identical everywhere
+    uint64_t seed = 0;
+
+    // rows of video changed since the frontend last looked, only DXYN, 00E0, scrolls and mode switches set these
+    bool videoDirty = false;
+    uint8_t dirtyTop = 0;    // first changed row
+    uint8_t dirtyBottom = 0; // last changed row
+
+    // length of the loop the last Run ended up spinning in, 0 if it wasn't idle
+    // 1 for FX0A with no key down or a jump to itself, 3 for a FX07 / 3XNN / 1NNN delay timer poll
+    // one pass round such a loop leaves the machine exactly as it was, so Run skips whole passes
+    uint8_t idleLoop = 0;
+    bool skipIdle = true; // off runs every pass round such a loop, chip8-bench times instructions that way
+
+    // how many instructions of its sequence the last fused handler ran, a skip can cut it short
+    uint8_t fusedRan = 0;
+
+    Instruction decoded[4096]; // decoded instruction cache, indexed by address
+    Chip8Jit *jit = NULL;      // optional native backend, told about code writes
+    Chip8Aot *aot = NULL;      // optional recompiled ROM, told about code writes
+    Chip8Trace *trace = NULL;  // optional instruction log, Run goes a Cycle at a time while it is set
+
+#ifdef CHIP8_STATS
+    Chip8Stats stats; // counts instructions run through Run and DecodeOpcode
+#endif
+
+    bool ResetCPU(char *filename);   // initialize CPU, false if the ROM can't be loaded
+    void ResetCPU(const Chip8Rom &); // same from a cached ROM, one copy of its image
+    void ResetCPU(const uint8_t *rom, size_t size); // same, ROM already in memory
+    void Boot();                    // registers, font, screen, stack and timers back to power on
     void Cycle();
+    void Run(uint64_t); // run a number of cycles back to back
+    void Execute(uint64_t); // same as Run without a trace
+    void RunFrame();    // one 60 Hz frame, instructionsPerFrame cycles then a timer tick
+    void TickTimers();  // count delay and sound timers down by one
+    void SetQuirks(const Chip8Quirks &); // switch profile, takes effect from the next instruction
+    static const Chip8Quirks *FindQuirks(const char *name); // profile by name, NULL if there is none
+    void Seed(uint64_t); // restart the random number sequence
+    uint8_t Random();    // next random byte
+    uint64_t Hash();    // fingerprint of the machine state, for comparing runs
+    static uint64_t HashBytes(uint64_t, const void *, size_t); // FNV-1a step
+
+    void SaveState(Chip8State &) const;  // copy the machine state out
+    void LoadState(const Chip8State &); // put a saved state back, decoded code is kept where memory matches
+
+    int Width() const { return hires ? 128 : 64; }
+    int Height() const { return hires ? 64 : 32; }
+
+    void MarkDirty(int top, int bottom); // add rows to the changed range
+    void ClearDirty();                   // frontend has caught up with video
 
     uint16_t GetNextOpcode(); // get next instruction for execution
 
+    static Instruction Decode(uint16_t, const Chip8Quirks & = QUIRKS_DEFAULT); // pick the handler and operands for an opcode
+    template <const Chip8Quirks &Q>
+    static Instruction DecodeAs(uint16_t); // same for one profile
+    static const char *OpcodeName(uint16_t); // family an opcode belongs to, "8XY4" etc
+    void RunAlone(uint16_t opcode);          // run one instruction that is cached fused with the ones after it
+    Instruction DecodeAt(uint16_t address);  // Decode the instruction at an address, fused with the next ones if they make a common sequence
+    template <const Chip8Quirks &Q>
+    Instruction FuseAs(uint16_t address); // same for one profile
+    void InvalidateCode(uint16_t, int);  // forget decoded instructions overlapping written bytes
+    bool TimerPoll(uint16_t);            // FX07 / 3XNN at an address that won't exit until the timer moves
+    template <const Chip8Quirks &Q>
+    void Draw(const Instruction &, int height, bool wide); // DXYN and DXY0, wide sprites are 16 pixels across
+    void Halt(uint8_t fault);            // record a fault and stop on the current instruction
+
+    // turn a member handler into a plain function pointer for the cache
+    template <void (Chip8::*Op)(const Instruction &)>
+    static void Call(Chip8 &chip8, const Instruction &ins)
+    {
+        (chip8.*Op)(ins);
+    }
+
+    // fused sequences, the first instruction's handler then the next ones' with their operands from
+    // the cache, each exactly as Run would have run it, a third one only runs if PC got to it
+    template <void (Chip8::*Op)(const Instruction &)>
+    void Step()
+    {
+        const Instruction &ins = decoded[programCounter & 0xFFF];
+        opcode = ins.opcode;
+        CHIP8_STAT(stats.Count(programCounter, opcode));
+        programCounter += 2;
+        (this->*Op)(ins);
+    }
+    template <void (Chip8::*A)(const Instruction &), void (Chip8::*B)(const Instruction &)>
+    static void Fused(Chip8 &chip8, const Instruction &ins)
+    {
+        (chip8.*A)(ins);
+        chip8.Step<B>();
+        chip8.fusedRan = 2;
+    }
+    template <void (Chip8::*A)(const Instruction &), void (Chip8::*B)(const Instruction &), void (Chip8::*C)(const Instruction &)>
+    static void Fused(Chip8 &chip8, const Instruction &ins)
+    {
+        (chip8.*A)(ins);
+        uint16_t third = chip8.programCounter + 2;
+        chip8.Step<B>();
+        chip8.fusedRan = 2;
+        if (chip8.programCounter != third)
+            return; // B skipped over it
+        chip8.Step<C>();
+        chip8.fusedRan = 3;
+    }
+
     // opcodes
-    void DecodeOpcode(uint16_t); // run the proper instruction from given opcode
-    void Opcode_1NNN(uint16_t);  // goto address NNN
-    void Opcode_00E0(uint16_t);  // clears the screen
-    void Opcode_00EE(uint16_t);  // return from a subroutine
-    void Opcode_2NNN(uint16_t);  // calls subroutine at NNN
-    void Opcode_3XNN(uint16_t);  // skips next instruction if VX == NN
-    void Opcode_4XNN(uint16_t);  // skips next instruction if VX != NN
-    void Opcode_5XY0(uint16_t);  // skip next instruction if VX == VY
-    void Opcode_6XNN(uint16_t);  // sets VX to NN
-    void Opcode_7XNN(uint16_t);  // adds NN to VX, carry flag unchanged
-    void Opcode_8XY0(uint16_t);  // VX = VY
-    void Opcode_8XY1(uint16_t);  // VX |= VY
-    void Opcode_8XY2(uint16_t);  // VX &= VY
-    void Opcode_8XY3(uint16_t);  // VX ^= VY
-    void Opcode_8XY4(uint16_t);  // VX += VY, VF set to 1 if overflow
-    void Opcode_8XY5(uint16_t);  // subtract VY from VX, VF set to 0 if underflow
-    void Opcode_8XY6(uint16_t);  // VX >>= 1, store LSB prior to shift in VF
-    void Opcode_8XY7(uint16_t);  // VX = VY - VX, VF set to 0 if underflow
-    void Opcode_8XYE(uint16_t);  // VX <<= 1, VF set to 1 if MSB prior to shift was set, otherwise 0
-    void Opcode_9XY0(uint16_t);  // skip next instruction if VX != VY
-    void Opcode_ANNN(uint16_t);  // set I to address NNN
-    void Opcode_BNNN(uint16_t);  // jump to address NNN + V0
-    void Opcode_CXNN(uint16_t);  // set VX to ranodm int (0 to 255) & NN (bitwise operation)
-    void Opcode_DXYN(uint16_t);  // draw sprite
-    void Opcode_EX9E(uint16_t);  // skip next instruction if key in VX is pressed
-    void Opcode_EXA1(uint16_t);  // skip next instruction if key in VX is NOT pressed
-    void Opcode_FX07(uint16_t);  // set VX to value of delay timer
-    void Opcode_FX0A(uint16_t);  // await key press and store in VX
-    void Opcode_FX15(uint16_t);  // set delay timer to VX
-    void Opcode_FX18(uint16_t);  // set sound timer to VX
-    void Opcode_FX1E(uint16_t);  // add VX to I
-    void Opcode_FX29(uint16_t);  // set I to sprite location for character in VX
-    void Opcode_FX33(uint16_t);  // store binary-coded decimal representation of VX at I, I+1, I+2
-    void Opcode_FX55(uint16_t);  // store from V0 to VX with values from memory, starting at I (I left unmodified)
-    void Opcode_FX65(uint16_t);  // fills from V0 to VX with values from memory, starting at I (I left unmodified)
+    void DecodeOpcode(uint16_t);           // run the proper instruction from given opcode
+    void Opcode_1NNN(const Instruction &); // goto address NNN
+    void Opcode_00E0(const Instruction &); // clears the screen
+    void Opcode_00EE(const Instruction &); // return from a subroutine
+    void Opcode_00CN(const Instruction &); // scroll down N rows (SUPER-CHIP)
+    void Opcode_00DN(const Instruction &); // scroll up N rows (XO-CHIP)
+    void Opcode_00FB(const Instruction &); // scroll right 4 pixels (SUPER-CHIP)
+    void Opcode_00FC(const Instruction &); // scroll left 4 pixels (SUPER-CHIP)
+    void Opcode_00FD(const Instruction &); // exit (SUPER-CHIP)
+    void Opcode_00FE(const Instruction &); // 64x32 low-res mode, clears the screen (SUPER-CHIP)
+    void Opcode_00FF(const Instruction &); // 128x64 high-res mode, clears the screen (SUPER-CHIP)
+    void Opcode_2NNN(const Instruction &); // calls subroutine at NNN
+    void Opcode_3XNN(const Instruction &); // skips next instruction if VX == NN
+    void Opcode_4XNN(const Instruction &); // skips next instruction if VX != NN
+    void Opcode_5XY0(const Instruction &); // skip next instruction if VX == VY
+    void Opcode_5XY2(const Instruction &); // store VX to VY in memory starting at I (XO-CHIP)
+    void Opcode_5XY3(const Instruction &); // load VX to VY from memory starting at I (XO-CHIP)
+    void Opcode_6XNN(const Instruction &); // sets VX to NN
+    void Opcode_7XNN(const Instruction &); // adds NN to VX, carry flag unchanged
+    void Opcode_8XY0(const Instruction &); // VX = VY
+    template <const Chip8Quirks &Q>
+    void Opcode_8XY1(const Instruction &); // VX |= VY
+    template <const Chip8Quirks &Q>
+    void Opcode_8XY2(const Instruction &); // VX &= VY
+    template <const Chip8Quirks &Q>
+    void Opcode_8XY3(const Instruction &); // VX ^= VY
+    void Opcode_8XY4(const Instruction &); // VX += VY, VF set to 1 if overflow
+    void Opcode_8XY5(const Instruction &); // subtract VY from VX, VF set to 0 if underflow
+    template <const Chip8Quirks &Q>
+    void Opcode_8XY6(const Instruction &); // VX >>= 1, store LSB prior to shift in VF
+    void Opcode_8XY7(const Instruction &); // VX = VY - VX, VF set to 0 if underflow
+    template <const Chip8Quirks &Q>
+    void Opcode_8XYE(const Instruction &); // VX <<= 1, VF set to 1 if MSB prior to shift was set, otherwise 0
+    void Opcode_9XY0(const Instruction &); // skip next instruction if VX != VY
+    void Opcode_ANNN(const Instruction &); // set I to address NNN
+    template <const Chip8Quirks &Q>
+    void Opcode_BNNN(const Instruction &); // jump to address NNN + V0
+    void Opcode_CXNN(const Instruction &); // set VX to ranodm int (0 to 255) & NN (bitwise operation)
+    template <const Chip8Quirks &Q>
+    void Opcode_DXYN(const Instruction &); // draw sprite
+    template <const Chip8Quirks &Q>
+    void Opcode_DXY0(const Instruction &); // draw 16x16 sprite (SUPER-CHIP)
+    void Opcode_EX9E(const Instruction &); // skip next instruction if key in VX is pressed
+    void Opcode_EXA1(const Instruction &); // skip next instruction if key in VX is NOT pressed
+    void Opcode_FX07(const Instruction &); // set VX to value of delay timer
+    void Opcode_FX0A(const Instruction &); // await key press and store in VX
+    void Opcode_FX15(const Instruction &); // set delay timer to VX
+    void Opcode_FX18(const Instruction &); // set sound timer to VX
+    void Opcode_FX1E(const Instruction &); // add VX to I
+    void Opcode_FN01(const Instruction &); // select bitplanes N for drawing, scrolling and clearing (XO-CHIP)
+    void Opcode_FX29(const Instruction &); // set I to sprite location for character in VX
+    void Opcode_FX30(const Instruction &); // set I to 8x10 sprite location for character in VX (SUPER-CHIP)
+    void Opcode_FX33(const Instruction &); // store binary-coded decimal representation of VX at I, I+1, I+2
+    template <const Chip8Quirks &Q>
+    void Opcode_FX55(const Instruction &); // store from V0 to VX with values from memory, starting at I (I left unmodified by default)
+    template <const Chip8Quirks &Q>
+    void Opcode_FX65(const Instruction &); // fills from V0 to VX with values from memory, starting at I (I left unmodified by default)
+    void Opcode_FX75(const Instruction &); // store V0 to VX in the user flags (SUPER-CHIP)
+    void Opcode_FX85(const Instruction &); // fill V0 to VX from the user flags (SUPER-CHIP)
+    void Opcode_NONE(const Instruction &); // opcode not found, do nothing
 };
+
+// copied with memcpy, packed in arrays and diffed a word at a time, keep it that way
+static_assert(std::is_trivially_copyable<Chip8State>::value, "Chip8State must stay plain data");
+static_assert(sizeof(Chip8State) == 6272, "Chip8State layout changed, update the documented size");
+static_assert(alignof(Chip8State) == 64, "Chip8State should start on a cache line");
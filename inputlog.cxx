@@ -0,0 +1,110 @@
+#include "inputlog.h"
+#include <algorithm>
+
+void Chip8InputLog::Start(const Chip8 &chip8)
+{
+    seed = chip8.seed;
+    quirks = chip8.quirks;
+    events.clear();
+    frame = 0;
+    memset(keys, 0, sizeof(keys));
+}
+
+void Chip8InputLog::Record(const Chip8 &chip8)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        uint8_t down = chip8.inputKeys[i] != 0;
+        if (down != keys[i])
+        {
+            Event e = {frame, (uint8_t)i, down};
+            events.push_back(e);
+            keys[i] = down;
+        }
+    }
+    frame++;
+}
+
+void Chip8InputLog::Restart(Chip8 &chip8)
+{
+    chip8.seed = seed;
+    chip8.SetQuirks(*quirks);
+    memset(chip8.inputKeys, 0, sizeof(chip8.inputKeys));
+    frame = 0;
+    position = 0;
+}
+
+void Chip8InputLog::Replay(Chip8 &chip8)
+{
+    while (position < events.size() && events[position].frame <= frame)
+    {
+        chip8.inputKeys[events[position].key] = events[position].down;
+        position++;
+    }
+    frame++;
+}
+
+bool Chip8InputLog::Finished()
+{
+    return position >= events.size();
+}
+
+bool Chip8InputLog::Save(const char *filename)
+{
+    FILE *out = fopen(filename, "w");
+    if (out == NULL)
+        return false;
+
+    fprintf(out, "seed %016llx\n", (unsigned long long)seed);
+    if (quirks != &QUIRKS_DEFAULT)
+        fprintf(out, "quirks %s\n", quirks->name);
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        fprintf(out, "%llu %X %d\n", (unsigned long long)events[i].frame, events[i].key, events[i].down);
+    }
+    return fclose(out) == 0;
+}
+
+bool Chip8InputLog::Load(const char *filename)
+{
+    FILE *in = fopen(filename, "r");
+    if (in == NULL)
+        return false;
+
+    unsigned long long value;
+    if (fscanf(in, "seed %llx", &value) != 1)
+    {
+        fclose(in);
+        return false;
+    }
+    seed = value;
+
+    // older logs have no profile line
+    char name[16];
+    quirks = &QUIRKS_DEFAULT;
+    if (fscanf(in, " quirks %15s", name) == 1)
+        quirks = Chip8::FindQuirks(name);
+    if (quirks == NULL)
+    {
+        fclose(in);
+        return false;
+    }
+
+    events.clear();
+    unsigned int key;
+    int down;
+    while (fscanf(in, "%llu %x %d", &value, &key, &down) == 3)
+    {
+        Event e = {value, (uint8_t)(key & 0xF), (uint8_t)(down != 0)};
+        events.push_back(e);
+    }
+    fclose(in);
+
+    // hand edited logs may be out of order
+    std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b)
+                     { return a.frame < b.frame; });
+
+    frame = 0;
+    position = 0;
+    return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "chip8.h"
+
+// key presses by frame number, enough to play a run back exactly
+// text file: first line "seed <hex>", "quirks <profile>" when it isn't the default,
+// then one change per line "<frame> <key 0-F> <1 down | 0 up>"
+// frame 0 is the first frame after ResetCPU, changes apply before that frame runs
+class Chip8InputLog
+{
+public:
+    struct Event
+    {
+        uint64_t frame;
+        uint8_t key;
+        uint8_t down;
+    };
+
+    uint64_t seed;
+    const Chip8Quirks *quirks = &QUIRKS_DEFAULT; // the run only plays back the same under the same profile
+    std::vector<Event> events;
+
+    void Start(const Chip8 &chip8); // begin a new recording, after ResetCPU
+    void Record(const Chip8 &chip8); // once per frame before it runs, logs keys that changed
+    void Restart(Chip8 &chip8);      // go back to the first event, seed and profile, before ResetCPU
+    void Replay(Chip8 &chip8);       // once per frame before it runs, sets the logged keys
+    bool Finished();                 // every event has been replayed
+
+    bool Save(const char *filename);
+    bool Load(const char *filename);
+
+private:
+    uint64_t frame;   // frames recorded or replayed so far
+    size_t position;  // next event to replay
+    uint8_t keys[16]; // keys as of the last recorded frame
+};
@@ -0,0 +1,394 @@
+#include "jit.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X64 1
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// x86-64 register numbers used in ModRM bytes
+enum
+{
+    EAX = 0,
+    ECX = 1,
+    EDX = 2,
+    ESI = 6,
+    EDI = 7,
+};
+
+// blocks get the Chip8 pointer as their only argument
+#ifdef _WIN32
+static const int BASE = ECX; // Microsoft x64 calling convention
+#else
+static const int BASE = EDI; // System V calling convention
+#endif
+
+// appends machine code to a buffer
+struct Emitter
+{
+    uint8_t *out;
+
+    void Byte(uint8_t b)
+    {
+        *out++ = b;
+    }
+
+    void Word(uint16_t w)
+    {
+        Byte(w & 0xFF);
+        Byte(w >> 8);
+    }
+
+    // ModRM for [BASE + disp32], reg is a register number or an opcode extension
+    void Mem(int reg, int32_t disp)
+    {
+        Byte(0x80 | (reg << 3) | BASE);
+        Byte(disp & 0xFF);
+        Byte((disp >> 8) & 0xFF);
+        Byte((disp >> 16) & 0xFF);
+        Byte((disp >> 24) & 0xFF);
+    }
+};
+
+// the code buffer is never writable and executable at once, hardened kernels and SELinux
+// execmem refuse that, it is writable while Compile emits and executable the rest of the time
+bool Chip8Jit::Protect(bool writable)
+{
+#ifdef _WIN32
+    DWORD old;
+    return VirtualProtect(codeBase, CODE_SIZE, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old) != 0;
+#else
+    return mprotect(codeBase, CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+Chip8Jit::Chip8Jit()
+{
+    memset(blocks, 0, sizeof(blocks));
+    codeBase = NULL;
+    codeUsed = 0;
+
+#ifdef JIT_X64
+#ifdef _WIN32
+    codeBase = (uint8_t *)VirtualAlloc(NULL, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void *mem = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED)
+        codeBase = (uint8_t *)mem;
+#endif
+    // a system that won't let it become executable gets the interpreter, Available says so
+    if (codeBase != NULL && !Protect(false))
+    {
+#ifdef _WIN32
+        VirtualFree(codeBase, 0, MEM_RELEASE);
+#else
+        munmap(codeBase, CODE_SIZE);
+#endif
+        codeBase = NULL;
+    }
+#endif
+}
+
+Chip8Jit::~Chip8Jit()
+{
+    if (codeBase == NULL)
+        return;
+#ifdef _WIN32
+    VirtualFree(codeBase, 0, MEM_RELEASE);
+#else
+    munmap(codeBase, CODE_SIZE);
+#endif
+}
+
+bool Chip8Jit::Available()
+{
+    return codeBase != NULL;
+}
+
+void Chip8Jit::Attach(Chip8 &chip8)
+{
+    chip8.jit = this;
+    Flush();
+}
+
+void Chip8Jit::Flush()
+{
+    for (size_t i = 0; i < live.size(); i++)
+    {
+        blocks[live[i]].valid = false;
+    }
+    live.clear();
+    codeUsed = 0;
+}
+
+void Chip8Jit::Invalidate(uint16_t address, int length)
+{
+    if (length >= 4096)
+    {
+        Flush();
+        return;
+    }
+
+    int first = address & 0xFFF;
+    int last = first + length; // may run past 0xFFF, writes wrap
+    for (size_t i = 0; i < live.size();)
+    {
+        Block &b = blocks[live[i]];
+        bool hit = (b.start < last && b.end > first) ||
+                   (last > 0x1000 && b.start < last - 0x1000);
+        if (hit)
+        {
+            b.valid = false;
+            live[i] = live.back();
+            live.pop_back();
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+void Chip8Jit::Run(Chip8 &chip8, uint64_t cycles)
+{
+    uint64_t done = 0;
+    while (done < cycles)
+    {
+        uint16_t pc = chip8.programCounter;
+        if (pc > 0xFFF || codeBase == NULL)
+        {
+            chip8.Cycle();
+            done++;
+            continue;
+        }
+
+        Block &b = blocks[pc];
+        if (!b.valid)
+            Compile(chip8, pc);
+
+        // leave the tail of the budget to the interpreter so counts match exactly
+        if (b.code == NULL || (uint64_t)b.count > cycles - done)
+        {
+            chip8.Cycle();
+            done++;
+            continue;
+        }
+
+        b.code(&chip8);
+        done += b.count;
+    }
+}
+
+void Chip8Jit::RunFrame(Chip8 &chip8)
+{
+    Run(chip8, chip8.instructionsPerFrame);
+    chip8.TickTimers();
+}
+
+void Chip8Jit::Compile(Chip8 &chip8, uint16_t start)
+{
+    Block &b = blocks[start];
+    b.code = NULL;
+    b.start = start;
+    b.end = start + 2;
+    b.count = 0;
+    b.valid = true;
+    live.push_back(start);
+
+#ifdef JIT_X64
+    // worst case is a skip at the end of a full block, keep plenty of room
+    if (codeUsed + MAX_BLOCK * 32 + 64 > CODE_SIZE)
+    {
+        Flush();
+        b.valid = true;
+        live.push_back(start);
+    }
+
+    // field offsets inside Chip8, the block addresses everything relative to it
+    uint8_t *base = (uint8_t *)&chip8;
+    int32_t offV = (uint8_t *)chip8.registers - base;
+    int32_t offVF = offV + 0xF;
+    int32_t offI = (uint8_t *)&chip8.indexRegister - base;
+    int32_t offPC = (uint8_t *)&chip8.programCounter - base;
+    int32_t offOp = (uint8_t *)&chip8.opcode - base;
+
+    uint8_t *code = codeBase + codeUsed;
+    Emitter e = {code};
+    if (!Protect(true))
+        return; // interpreted
+
+    uint16_t pc = start;
+    uint16_t lastOpcode = 0;
+    bool ended = false; // block finished by a translated jump or skip
+    int count = 0;
+
+    while (count < MAX_BLOCK && pc + 1 <= 0xFFF && !ended)
+    {
+        uint16_t opcode = (chip8.memory[pc] << 8) | chip8.memory[pc + 1];
+        int x = (opcode & 0x0F00) >> 8;
+        int y = (opcode & 0x00F0) >> 4;
+        int nn = opcode & 0x00FF;
+        int nnn = opcode & 0x0FFF;
+        int shifted = chip8.quirks->shiftVY ? y : x; // 8XY6 and 8XYE source
+        bool translated = true;
+
+        switch (opcode & 0xF000)
+        {
+        case 0x1000:
+            // mov word [PC], nnn
+            e.Byte(0x66), e.Byte(0xC7), e.Mem(0, offPC), e.Word(nnn);
+            ended = true;
+            break;
+        case 0x3000:
+        case 0x4000:
+        case 0x5000:
+        case 0x9000:
+            if ((opcode & 0xF000) == 0x5000 || (opcode & 0xF000) == 0x9000)
+            {
+                if ((opcode & 0x000F) != 0)
+                {
+                    translated = false;
+                    break;
+                }
+                // mov al, [VX] / cmp al, [VY]
+                e.Byte(0x8A), e.Mem(EAX, offV + x);
+                e.Byte(0x3A), e.Mem(EAX, offV + y);
+            }
+            else
+            {
+                // cmp byte [VX], nn
+                e.Byte(0x80), e.Mem(7, offV + x), e.Byte(nn);
+            }
+            // mov leaves flags alone, so set the fall through PC and then maybe the skip
+            e.Byte(0x66), e.Byte(0xC7), e.Mem(0, offPC), e.Word(pc + 2);
+            // 3XNN and 5XY0 skip on equal, 4XNN and 9XY0 on not equal
+            e.Byte(((opcode & 0xF000) == 0x3000 || (opcode & 0xF000) == 0x5000) ? 0x75 : 0x74);
+            e.Byte(9);
+            e.Byte(0x66), e.Byte(0xC7), e.Mem(0, offPC), e.Word(pc + 4);
+            ended = true;
+            break;
+        case 0x6000:
+            // mov byte [VX], nn
+            e.Byte(0xC6), e.Mem(0, offV + x), e.Byte(nn);
+            break;
+        case 0x7000:
+            // add byte [VX], nn
+            e.Byte(0x80), e.Mem(0, offV + x), e.Byte(nn);
+            break;
+        case 0x8000:
+            switch (opcode & 0x000F)
+            {
+            case 0x0:
+            case 0x1:
+            case 0x2:
+            case 0x3:
+            {
+                static const uint8_t ops[4] = {0x88, 0x08, 0x20, 0x30}; // mov, or, and, xor
+                e.Byte(0x8A), e.Mem(EAX, offV + y);                    // mov al, [VY]
+                e.Byte(ops[opcode & 0x3]), e.Mem(EAX, offV + x);       // op [VX], al
+                if ((opcode & 0x3) != 0 && chip8.quirks->logicResetsVF)
+                    e.Byte(0xC6), e.Mem(0, offVF), e.Byte(0); // mov byte [VF], 0
+                break;
+            }
+            case 0x4:
+                e.Byte(0x0F), e.Byte(0xB6), e.Mem(EAX, offV + x); // movzx eax, byte [VX]
+                e.Byte(0x0F), e.Byte(0xB6), e.Mem(EDX, offV + y); // movzx edx, byte [VY]
+                e.Byte(0x01), e.Byte(0xD0);                       // add eax, edx
+                e.Byte(0x88), e.Mem(EAX, offV + x);               // mov [VX], al
+                e.Byte(0xC1), e.Byte(0xE8), e.Byte(8);            // shr eax, 8
+                e.Byte(0x88), e.Mem(EAX, offVF);                  // mov [VF], al
+                break;
+            case 0x5:
+            case 0x7:
+            {
+                // 8XY5 is VX - VY, 8XY7 is VY - VX, VF is 1 when there was no borrow
+                int a = (opcode & 0x000F) == 0x5 ? x : y;
+                int s = (opcode & 0x000F) == 0x5 ? y : x;
+                e.Byte(0x0F), e.Byte(0xB6), e.Mem(EAX, offV + a); // movzx eax, byte [a]
+                e.Byte(0x0F), e.Byte(0xB6), e.Mem(EDX, offV + s); // movzx edx, byte [s]
+                e.Byte(0x29), e.Byte(0xD0);                       // sub eax, edx
+                e.Byte(0x0F), e.Byte(0x93), e.Byte(0xC2);         // setae dl
+                e.Byte(0x88), e.Mem(EAX, offV + x);               // mov [VX], al
+                e.Byte(0x88), e.Mem(EDX, offVF);                  // mov [VF], dl
+                break;
+            }
+            case 0x6:
+                e.Byte(0x0F), e.Byte(0xB6), e.Mem(EAX, offV + shifted); // movzx eax, byte [VX or VY]
+                e.Byte(0x89), e.Byte(0xC2);                       // mov edx, eax
+                e.Byte(0x83), e.Byte(0xE2), e.Byte(1);            // and edx, 1
+                e.Byte(0xD1), e.Byte(0xE8);                       // shr eax, 1
+                e.Byte(0x88), e.Mem(EAX, offV + x);               // mov [VX], al
+                e.Byte(0x88), e.Mem(EDX, offVF);                  // mov [VF], dl
+                break;
+            case 0xE:
+                e.Byte(0x0F), e.Byte(0xB6), e.Mem(EAX, offV + shifted); // movzx eax, byte [VX or VY]
+                e.Byte(0x89), e.Byte(0xC2);                       // mov edx, eax
+                e.Byte(0xC1), e.Byte(0xEA), e.Byte(7);            // shr edx, 7
+                e.Byte(0xD1), e.Byte(0xE0);                       // shl eax, 1
+                e.Byte(0x88), e.Mem(EAX, offV + x);               // mov [VX], al
+                e.Byte(0x88), e.Mem(EDX, offVF);                  // mov [VF], dl
+                break;
+            default:
+                translated = false;
+                break;
+            }
+            break;
+        case 0xA000:
+            // mov word [I], nnn
+            e.Byte(0x66), e.Byte(0xC7), e.Mem(0, offI), e.Word(nnn);
+            break;
+        case 0xF000:
+            if ((opcode & 0x00FF) == 0x1E)
+            {
+                e.Byte(0x0F), e.Byte(0xB6), e.Mem(EAX, offV + x); // movzx eax, byte [VX]
+                e.Byte(0x66), e.Byte(0x01), e.Mem(EAX, offI);     // add word [I], ax
+            }
+            else if ((opcode & 0x00FF) == 0x29)
+            {
+                e.Byte(0x0F), e.Byte(0xB6), e.Mem(EAX, offV + x);         // movzx eax, byte [VX]
+                e.Byte(0x8D), e.Byte(0x44), e.Byte(0x80), e.Byte(0x50); // lea eax, [rax + rax * 4 + 0x50]
+                e.Byte(0x66), e.Byte(0x89), e.Mem(EAX, offI);           // mov word [I], ax
+            }
+            else
+            {
+                translated = false;
+            }
+            break;
+        default:
+            // calls, returns, draws, keys, timers and memory ops stay in the interpreter
+            translated = false;
+            break;
+        }
+
+        if (!translated)
+            break;
+
+        lastOpcode = opcode;
+        pc += 2;
+        count++;
+    }
+
+    if (count == 0)
+    {
+        Protect(false);
+        return; // first instruction is interpreted, nothing to emit
+    }
+
+    // straight line blocks fall through to the instruction the interpreter runs next
+    if (!ended)
+        e.Byte(0x66), e.Byte(0xC7), e.Mem(0, offPC), e.Word(pc);
+    e.Byte(0x66), e.Byte(0xC7), e.Mem(0, offOp), e.Word(lastOpcode); // mov word [opcode], last
+    e.Byte(0xC3);                                                       // ret
+
+    b.code = (BlockCode)code;
+    b.end = pc;
+    b.count = count;
+    codeUsed += e.out - code;
+    if (!Protect(false))
+        b.code = NULL; // can't run it, interpreted
+#endif
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "chip8.h"
+
+// optional dynamic recompiler, translates straight-line CHIP-8 code into x86-64
+// anything it can't translate is left to the interpreter (Chip8::Cycle)
+class Chip8Jit
+{
+public:
+    Chip8Jit();
+    ~Chip8Jit();
+
+    bool Available(); // false if not x86-64 or no executable memory
+
+    void Attach(Chip8 &chip8);               // start receiving code writes from this Chip8
+    void Run(Chip8 &chip8, uint64_t cycles); // same result as chip8.Run(cycles)
+    void RunFrame(Chip8 &chip8);             // same result as chip8.RunFrame()
+    void Invalidate(uint16_t address, int length); // drop blocks overlapping written bytes
+    void Flush();                                  // drop every block
+
+private:
+    typedef void (*BlockCode)(Chip8 *);
+
+    static const int MAX_BLOCK = 64;          // instructions per block
+    static const size_t CODE_SIZE = 1 << 20; // bytes of executable memory
+
+    // one translated basic block, stored by start address
+    struct Block
+    {
+        BlockCode code; // NULL if the first instruction has to be interpreted
+        uint16_t start; // first byte covered
+        uint16_t end;   // one past last byte covered
+        int count;      // instructions executed by one call
+        bool valid;
+    };
+
+    Block blocks[4096];
+    std::vector<uint16_t> live; // start addresses of valid blocks
+
+    uint8_t *codeBase; // executable memory, writable only inside Compile
+    size_t codeUsed;
+
+    void Compile(Chip8 &chip8, uint16_t start);
+    bool Protect(bool writable); // switch the code buffer between writable and executable
+};
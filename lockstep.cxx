@@ -0,0 +1,640 @@
+#include "lockstep.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define HANDLER(op) &Chip8::Call<&Chip8::op>
+
+Chip8Lockstep::Chip8Lockstep(int count)
+{
+    if (count < 1)
+        count = 1;
+    if (count > LANES)
+        count = LANES;
+    this->count = count;
+
+    for (int i = 0; i < LANES; i++)
+    {
+        machines[i] = new Chip8();
+    }
+    memset(V, 0, sizeof(V));
+    memset(I, 0, sizeof(I));
+    memset(PC, 0, sizeof(PC));
+    memset(delay, 0, sizeof(delay));
+    memset(sound, 0, sizeof(sound));
+    memset(remaining, 0, sizeof(remaining));
+    memset(ops, 0, sizeof(ops));
+    dirty = 0;
+    vectorSteps = 0;
+    scalarSteps = 0;
+    laneInstructions = 0;
+}
+
+Chip8Lockstep::~Chip8Lockstep()
+{
+    for (int i = 0; i < LANES; i++)
+    {
+        delete machines[i];
+    }
+}
+
+int Chip8Lockstep::Count()
+{
+    return count;
+}
+
+Chip8 &Chip8Lockstep::Lane(int lane)
+{
+    return *machines[lane];
+}
+
+void Chip8Lockstep::SetQuirks(const Chip8Quirks &profile)
+{
+    for (int i = 0; i < LANES; i++)
+    {
+        machines[i]->SetQuirks(profile);
+    }
+    memset(ops, 0, sizeof(ops)); // decoded with the old profile
+}
+
+bool Chip8Lockstep::ResetCPU(char *filename)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!machines[i]->ResetCPU(filename))
+            return false;
+    }
+    memset(ops, 0, sizeof(ops));
+    dirty = 0;
+    return true;
+}
+
+void Chip8Lockstep::Load()
+{
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        Chip8 &m = *machines[lane];
+        for (int r = 0; r < 16; r++)
+        {
+            V[r][lane] = m.registers[r];
+        }
+        I[lane] = m.indexRegister;
+        PC[lane] = m.programCounter;
+        delay[lane] = m.delayTimer;
+        sound[lane] = m.soundTimer;
+    }
+}
+
+void Chip8Lockstep::Store()
+{
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        Chip8 &m = *machines[lane];
+        for (int r = 0; r < 16; r++)
+        {
+            m.registers[r] = V[r][lane];
+        }
+        m.indexRegister = I[lane];
+        m.programCounter = PC[lane];
+        m.delayTimer = delay[lane];
+        m.soundTimer = sound[lane];
+    }
+}
+
+const Chip8Lockstep::Op &Chip8Lockstep::Fetch(int leader, uint16_t pc)
+{
+    // lanes that never wrote memory all hold the ROM as loaded, so anything
+    // decoded from one of them stays good for the others without a recheck
+    Op &op = ops[pc & 0xFFF];
+    bool clean = ((dirty >> leader) & 1) == 0;
+    if (op.valid && op.clean && clean)
+        return op;
+
+    Chip8 &m = *machines[leader];
+    uint16_t opcode = (m.memory[pc & 0xFFF] << 8) | m.memory[(pc + 1) & 0xFFF];
+    if (op.valid && op.opcode == opcode)
+    {
+        op.clean |= clean;
+        return op;
+    }
+
+    // let the interpreter decide what the opcode is, so both agree on every odd encoding
+    // the kinds are the default profile's handlers, other profiles run their quirky opcodes scalar
+    static const struct
+    {
+        Chip8::Handler handler;
+        Kind kind;
+    } kinds[] = {
+        {HANDLER(Opcode_1NNN), JUMP},
+        {HANDLER(Opcode_3XNN), SKIP_EQ},
+        {HANDLER(Opcode_4XNN), SKIP_NE},
+        {HANDLER(Opcode_5XY0), SKIP_XY},
+        {HANDLER(Opcode_9XY0), SKIP_NY},
+        {HANDLER(Opcode_6XNN), SET},
+        {HANDLER(Opcode_7XNN), ADD},
+        {HANDLER(Opcode_8XY0), MOV},
+        {HANDLER(Opcode_8XY1<QUIRKS_DEFAULT>), OR},
+        {HANDLER(Opcode_8XY2<QUIRKS_DEFAULT>), AND},
+        {HANDLER(Opcode_8XY3<QUIRKS_DEFAULT>), XOR},
+        {HANDLER(Opcode_8XY4), ADC},
+        {HANDLER(Opcode_8XY5), SUB},
+        {HANDLER(Opcode_8XY6<QUIRKS_DEFAULT>), SHR},
+        {HANDLER(Opcode_8XY7), SUBN},
+        {HANDLER(Opcode_8XYE<QUIRKS_DEFAULT>), SHL},
+        {HANDLER(Opcode_ANNN), SET_I},
+        {HANDLER(Opcode_FX1E), ADD_I},
+        {HANDLER(Opcode_FX29), FONT},
+        {HANDLER(Opcode_FX07), GET_DT},
+        {HANDLER(Opcode_FX15), SET_DT},
+        {HANDLER(Opcode_FX18), SET_ST},
+    };
+
+    op.opcode = opcode;
+    op.valid = true;
+    op.clean = clean;
+    op.ins = Chip8::Decode(opcode, *m.quirks);
+    op.kind = SCALAR;
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+    {
+        if (kinds[i].handler == op.ins.handler)
+            op.kind = kinds[i].kind;
+    }
+    const char *name = Chip8::OpcodeName(opcode);
+    op.writes = strcmp(name, "FX33") == 0 || strcmp(name, "FX55") == 0 || strcmp(name, "5XY2") == 0;
+    return op;
+}
+
+void Chip8Lockstep::Scalar(const Op &op, uint32_t mask)
+{
+    // the interpreter may rewrite code in these lanes
+    if (op.writes)
+        dirty |= mask;
+
+    // hand each lane to its own interpreter for one instruction
+    while (mask != 0)
+    {
+        int lane = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        Chip8 &m = *machines[lane];
+        for (int r = 0; r < 16; r++)
+        {
+            m.registers[r] = V[r][lane];
+        }
+        m.indexRegister = I[lane];
+        m.programCounter = PC[lane];
+        m.delayTimer = delay[lane];
+        m.soundTimer = sound[lane];
+
+        m.Cycle();
+
+        for (int r = 0; r < 16; r++)
+        {
+            V[r][lane] = m.registers[r];
+        }
+        I[lane] = m.indexRegister;
+        PC[lane] = m.programCounter;
+        delay[lane] = m.delayTimer;
+        sound[lane] = m.soundTimer;
+        remaining[lane]--;
+        scalarSteps++;
+    }
+}
+
+#ifdef __AVX2__
+
+// 0xFF in every byte lane whose bit is set
+static inline __m256i ByteMask(uint32_t mask)
+{
+    __m256i bits = _mm256_set1_epi32(mask);
+    __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                      2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    __m256i select = _mm256_set1_epi64x(0x8040201008040201ll);
+    bits = _mm256_shuffle_epi8(bits, spread);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(bits, select), select);
+}
+
+// write value into the masked byte lanes of dst
+static inline void Put(uint8_t *dst, __m256i value, __m256i mask)
+{
+    __m256i old = _mm256_load_si256((__m256i *)dst);
+    _mm256_store_si256((__m256i *)dst, _mm256_blendv_epi8(old, value, mask));
+}
+
+// same for 16-bit lanes, lo is lanes 0-15 and hi is lanes 16-31
+static inline void Put16(uint16_t *dst, __m256i lo, __m256i hi, __m256i maskLo, __m256i maskHi)
+{
+    __m256i oldLo = _mm256_load_si256((__m256i *)dst);
+    __m256i oldHi = _mm256_load_si256((__m256i *)(dst + 16));
+    _mm256_store_si256((__m256i *)dst, _mm256_blendv_epi8(oldLo, lo, maskLo));
+    _mm256_store_si256((__m256i *)(dst + 16), _mm256_blendv_epi8(oldHi, hi, maskHi));
+}
+
+static inline __m256i Low16(__m256i bytes)
+{
+    return _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes));
+}
+
+static inline __m256i High16(__m256i bytes)
+{
+    return _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1));
+}
+
+uint32_t Chip8Lockstep::Group(uint32_t active, uint16_t &pc)
+{
+    // lanes with the lowest PC go next, the rest are most likely catching up
+    __m256i act = ByteMask(active);
+    __m256i actLo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(act));
+    __m256i actHi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(act, 1));
+    __m256i lo = _mm256_load_si256((__m256i *)PC);
+    __m256i hi = _mm256_load_si256((__m256i *)(PC + 16));
+    __m256i ones = _mm256_set1_epi16(-1);
+    lo = _mm256_or_si256(lo, _mm256_andnot_si256(actLo, ones)); // idle lanes never win
+    hi = _mm256_or_si256(hi, _mm256_andnot_si256(actHi, ones));
+
+    __m256i m = _mm256_min_epu16(lo, hi);
+    __m128i m128 = _mm_min_epu16(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+    pc = _mm_cvtsi128_si32(_mm_minpos_epu16(m128)) & 0xFFFF;
+
+    __m256i target = _mm256_set1_epi16(pc);
+    __m256i eqLo = _mm256_and_si256(_mm256_cmpeq_epi16(lo, target), actLo);
+    __m256i eqHi = _mm256_and_si256(_mm256_cmpeq_epi16(hi, target), actHi);
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(eqLo, eqHi), 0xD8);
+    return (uint32_t)_mm256_movemask_epi8(packed);
+}
+
+uint32_t Chip8Lockstep::Finished(uint32_t mask)
+{
+    uint32_t done = 0;
+    __m256i zero = _mm256_setzero_si256();
+    for (int i = 0; i < 4; i++)
+    {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_load_si256((__m256i *)(remaining + i * 8)), zero);
+        done |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << (i * 8);
+    }
+    return done & mask;
+}
+
+void Chip8Lockstep::Vector(const Op &op, uint32_t mask)
+{
+    const Chip8::Instruction &ins = op.ins;
+    __m256i m = ByteMask(mask);
+    __m256i mLo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(m));
+    __m256i mHi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(m, 1));
+    __m256i vx = _mm256_load_si256((__m256i *)V[ins.x]);
+    __m256i vy = _mm256_load_si256((__m256i *)V[ins.y]);
+    __m256i one = _mm256_set1_epi8(1);
+    __m256i step = _mm256_set1_epi16(2); // PC advance, 4 for taken skips
+    __m256i skip = _mm256_setzero_si256();
+
+    switch (op.kind)
+    {
+    case JUMP:
+    {
+        __m256i target = _mm256_set1_epi16(ins.nnn);
+        Put16(PC, target, target, mLo, mHi);
+        step = _mm256_setzero_si256();
+        break;
+    }
+    case SKIP_EQ:
+        skip = _mm256_cmpeq_epi8(vx, _mm256_set1_epi8(ins.nn));
+        break;
+    case SKIP_NE:
+        skip = _mm256_andnot_si256(_mm256_cmpeq_epi8(vx, _mm256_set1_epi8(ins.nn)), _mm256_set1_epi8(-1));
+        break;
+    case SKIP_XY:
+        skip = _mm256_cmpeq_epi8(vx, vy);
+        break;
+    case SKIP_NY:
+        skip = _mm256_andnot_si256(_mm256_cmpeq_epi8(vx, vy), _mm256_set1_epi8(-1));
+        break;
+    case SET:
+        Put(V[ins.x], _mm256_set1_epi8(ins.nn), m);
+        break;
+    case ADD:
+        Put(V[ins.x], _mm256_add_epi8(vx, _mm256_set1_epi8(ins.nn)), m);
+        break;
+    case MOV:
+        Put(V[ins.x], vy, m);
+        break;
+    case OR:
+        Put(V[ins.x], _mm256_or_si256(vx, vy), m);
+        break;
+    case AND:
+        Put(V[ins.x], _mm256_and_si256(vx, vy), m);
+        break;
+    case XOR:
+        Put(V[ins.x], _mm256_xor_si256(vx, vy), m);
+        break;
+    case ADC:
+    {
+        // carry out of the byte add shows up as the sum wrapping below VX
+        __m256i sum = _mm256_add_epi8(vx, vy);
+        __m256i noCarry = _mm256_cmpeq_epi8(_mm256_max_epu8(sum, vx), sum);
+        Put(V[ins.x], sum, m);
+        Put(V[0xF], _mm256_andnot_si256(noCarry, one), m);
+        break;
+    }
+    case SUB:
+    {
+        __m256i noBorrow = _mm256_cmpeq_epi8(_mm256_max_epu8(vx, vy), vx);
+        Put(V[ins.x], _mm256_sub_epi8(vx, vy), m);
+        Put(V[0xF], _mm256_and_si256(noBorrow, one), m);
+        break;
+    }
+    case SUBN:
+    {
+        __m256i noBorrow = _mm256_cmpeq_epi8(_mm256_max_epu8(vy, vx), vy);
+        Put(V[ins.x], _mm256_sub_epi8(vy, vx), m);
+        Put(V[0xF], _mm256_and_si256(noBorrow, one), m);
+        break;
+    }
+    case SHR:
+        // no 8-bit shifts, shift 16-bit lanes and drop the bit that crossed over
+        Put(V[ins.x], _mm256_and_si256(_mm256_srli_epi16(vx, 1), _mm256_set1_epi8(0x7F)), m);
+        Put(V[0xF], _mm256_and_si256(vx, one), m);
+        break;
+    case SHL:
+        Put(V[ins.x], _mm256_add_epi8(vx, vx), m);
+        Put(V[0xF], _mm256_and_si256(_mm256_srli_epi16(vx, 7), one), m);
+        break;
+    case SET_I:
+    {
+        __m256i nnn = _mm256_set1_epi16(ins.nnn);
+        Put16(I, nnn, nnn, mLo, mHi);
+        break;
+    }
+    case ADD_I:
+    {
+        __m256i lo = _mm256_add_epi16(_mm256_load_si256((__m256i *)I), Low16(vx));
+        __m256i hi = _mm256_add_epi16(_mm256_load_si256((__m256i *)(I + 16)), High16(vx));
+        Put16(I, lo, hi, mLo, mHi);
+        break;
+    }
+    case FONT:
+    {
+        __m256i five = _mm256_set1_epi16(5);
+        __m256i base = _mm256_set1_epi16(0x50);
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(Low16(vx), five), base);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(High16(vx), five), base);
+        Put16(I, lo, hi, mLo, mHi);
+        break;
+    }
+    case GET_DT:
+        Put(V[ins.x], _mm256_load_si256((__m256i *)delay), m);
+        break;
+    case SET_DT:
+        Put(delay, vx, m);
+        break;
+    case SET_ST:
+        Put(sound, vx, m);
+        break;
+    }
+
+    // advance PC, taken skips move it twice as far
+    __m256i skipLo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(skip));
+    __m256i skipHi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(skip, 1));
+    __m256i pcLo = _mm256_load_si256((__m256i *)PC);
+    __m256i pcHi = _mm256_load_si256((__m256i *)(PC + 16));
+    pcLo = _mm256_add_epi16(pcLo, _mm256_add_epi16(step, _mm256_and_si256(skipLo, step)));
+    pcHi = _mm256_add_epi16(pcHi, _mm256_add_epi16(step, _mm256_and_si256(skipHi, step)));
+    Put16(PC, pcLo, pcHi, mLo, mHi);
+
+    // count the instruction against each lane's budget
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i bytes = i < 2 ? _mm256_castsi256_si128(m) : _mm256_extracti128_si256(m, 1);
+        __m256i dec = _mm256_cvtepi8_epi32(i & 1 ? _mm_srli_si128(bytes, 8) : bytes);
+        __m256i *r = (__m256i *)(remaining + i * 8);
+        _mm256_store_si256(r, _mm256_add_epi32(_mm256_load_si256(r), dec));
+    }
+    vectorSteps++;
+}
+
+#else
+
+uint32_t Chip8Lockstep::Group(uint32_t active, uint16_t &pc)
+{
+    // lanes with the lowest PC go next, the rest are most likely catching up
+    pc = 0xFFFF;
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        if ((active >> lane) & 1 && PC[lane] < pc)
+            pc = PC[lane];
+    }
+    uint32_t mask = 0;
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        if ((active >> lane) & 1 && PC[lane] == pc)
+            mask |= 1u << lane;
+    }
+    return mask;
+}
+
+uint32_t Chip8Lockstep::Finished(uint32_t mask)
+{
+    uint32_t done = 0;
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        if (remaining[lane] == 0)
+            done |= 1u << lane;
+    }
+    return done & mask;
+}
+
+void Chip8Lockstep::Vector(const Op &op, uint32_t mask)
+{
+    const Chip8::Instruction &ins = op.ins;
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        if (((mask >> lane) & 1) == 0)
+            continue;
+
+        uint8_t vx = V[ins.x][lane];
+        uint8_t vy = V[ins.y][lane];
+        uint16_t next = PC[lane] + 2;
+
+        switch (op.kind)
+        {
+        case JUMP:
+            next = ins.nnn;
+            break;
+        case SKIP_EQ:
+            next += vx == ins.nn ? 2 : 0;
+            break;
+        case SKIP_NE:
+            next += vx != ins.nn ? 2 : 0;
+            break;
+        case SKIP_XY:
+            next += vx == vy ? 2 : 0;
+            break;
+        case SKIP_NY:
+            next += vx != vy ? 2 : 0;
+            break;
+        case SET:
+            V[ins.x][lane] = ins.nn;
+            break;
+        case ADD:
+            V[ins.x][lane] = vx + ins.nn;
+            break;
+        case MOV:
+            V[ins.x][lane] = vy;
+            break;
+        case OR:
+            V[ins.x][lane] = vx | vy;
+            break;
+        case AND:
+            V[ins.x][lane] = vx & vy;
+            break;
+        case XOR:
+            V[ins.x][lane] = vx ^ vy;
+            break;
+        case ADC:
+            V[ins.x][lane] = vx + vy;
+            V[0xF][lane] = vx + vy > 255;
+            break;
+        case SUB:
+            V[ins.x][lane] = vx - vy;
+            V[0xF][lane] = vx >= vy;
+            break;
+        case SUBN:
+            V[ins.x][lane] = vy - vx;
+            V[0xF][lane] = vy >= vx;
+            break;
+        case SHR:
+            V[ins.x][lane] = vx >> 1;
+            V[0xF][lane] = vx & 1;
+            break;
+        case SHL:
+            V[ins.x][lane] = vx << 1;
+            V[0xF][lane] = vx >> 7;
+            break;
+        case SET_I:
+            I[lane] = ins.nnn;
+            break;
+        case ADD_I:
+            I[lane] += vx;
+            break;
+        case FONT:
+            I[lane] = 0x50 + vx * 5;
+            break;
+        case GET_DT:
+            V[ins.x][lane] = delay[lane];
+            break;
+        case SET_DT:
+            delay[lane] = vx;
+            break;
+        case SET_ST:
+            sound[lane] = vx;
+            break;
+        }
+
+        PC[lane] = next;
+        remaining[lane]--;
+    }
+    vectorSteps++;
+}
+
+#endif
+
+void Chip8Lockstep::RunFrames(uint64_t frames)
+{
+    Load();
+
+    // every lane uses the first lane's speed so they stay in step
+    uint32_t perFrame = machines[0]->instructionsPerFrame;
+    for (uint64_t f = 0; f < frames; f++)
+    {
+        Steps(perFrame);
+
+        // timers tick once per frame
+        for (int lane = 0; lane < count; lane++)
+        {
+            if (delay[lane] > 0)
+                delay[lane]--;
+            if (sound[lane] > 0)
+                sound[lane]--;
+        }
+    }
+
+    Store();
+}
+
+void Chip8Lockstep::Run(uint64_t cycles)
+{
+    Load();
+
+    // budgets are 32-bit per lane, go round again for anything longer
+    while (cycles > 0)
+    {
+        uint32_t chunk = cycles > 0xFFFFFFFFull ? 0xFFFFFFFFu : (uint32_t)cycles;
+        cycles -= chunk;
+        Steps(chunk);
+    }
+
+    Store();
+}
+
+void Chip8Lockstep::Steps(uint32_t chunk)
+{
+    if (chunk == 0)
+        return;
+
+    uint32_t active = count == 32 ? 0xFFFFFFFFu : (1u << count) - 1;
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        remaining[lane] = (active >> lane) & 1 ? chunk : 0;
+    }
+
+    // while every active lane sits on the same PC there is no need to regroup
+    bool converged = false;
+    uint16_t pc = 0;
+
+    // steps that can run before any lane could possibly run out of budget
+    uint32_t safe = chunk;
+
+    while (active != 0)
+    {
+        uint32_t mask = converged ? active : Group(active, pc);
+        int leader = __builtin_ctz(mask);
+        const Op &op = Fetch(leader, pc);
+
+        // lanes that wrote memory may be looking at different code
+        uint32_t check = (dirty >> leader) & 1 ? mask : mask & dirty;
+        check &= ~(1u << leader);
+        while (check != 0)
+        {
+            int lane = __builtin_ctz(check);
+            check &= check - 1;
+            Chip8 &m = *machines[lane];
+            if (((m.memory[pc & 0xFFF] << 8) | m.memory[(pc + 1) & 0xFFF]) != op.opcode)
+                mask &= ~(1u << lane);
+        }
+
+        int executed = __builtin_popcount(mask);
+        if (op.kind == SCALAR)
+            Scalar(op, mask);
+        else
+            Vector(op, mask);
+        laneInstructions += executed;
+
+        // straight line code and jumps keep a converged group together, skips may split it
+        converged = mask == active && op.kind != SCALAR && (op.kind < SKIP_EQ || op.kind > SKIP_NY);
+        pc = op.kind == JUMP ? op.ins.nnn : pc + 2;
+
+        // drop lanes that used up their budget, a lane loses at most one per step
+        if (--safe == 0)
+        {
+            active &= ~Finished(active);
+            safe = 0xFFFFFFFFu;
+            for (int lane = 0; lane < LANES; lane++)
+            {
+                if ((active >> lane) & 1 && remaining[lane] < safe)
+                    safe = remaining[lane];
+            }
+        }
+    }
+}
+
+#undef HANDLER
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "chip8.h"
+
+// runs up to 32 instances of the same ROM in lockstep, one per vector lane
+// registers, I, PC and timers are kept structure-of-arrays so one AVX2 instruction
+// updates every lane, anything else runs on the lane's own Chip8
+// lanes whose PCs diverge are masked off and picked up again when they meet
+class Chip8Lockstep
+{
+public:
+    static const int LANES = 32;
+
+    Chip8Lockstep(int count); // number of instances, 1 to LANES
+    ~Chip8Lockstep();
+
+    int Count();
+    Chip8 &Lane(int lane);         // machine for one lane, up to date between Run calls
+    void SetQuirks(const Chip8Quirks &profile); // same profile on every lane
+    bool ResetCPU(char *filename); // load the same ROM into every lane, false if it can't be loaded
+    void Run(uint64_t cycles);     // every lane executes this many instructions
+    void RunFrames(uint64_t frames); // 60 Hz frames on every lane, timers included
+
+    uint64_t vectorSteps;      // instructions executed by the vector path, once for all its lanes
+    uint64_t scalarSteps;      // lane instructions handed to the interpreter
+    uint64_t laneInstructions; // instructions executed summed over all lanes
+
+private:
+    // what the vector path can do with an instruction, anything else is SCALAR
+    enum Kind
+    {
+        SCALAR,
+        JUMP,    // 1NNN
+        SKIP_EQ, // 3XNN
+        SKIP_NE, // 4XNN
+        SKIP_XY, // 5XY0
+        SKIP_NY, // 9XY0
+        SET,     // 6XNN
+        ADD,     // 7XNN
+        MOV,     // 8XY0
+        OR,      // 8XY1
+        AND,     // 8XY2
+        XOR,     // 8XY3
+        ADC,     // 8XY4
+        SUB,     // 8XY5
+        SHR,     // 8XY6
+        SUBN,    // 8XY7
+        SHL,     // 8XYE
+        SET_I,   // ANNN
+        ADD_I,   // FX1E
+        FONT,    // FX29
+        GET_DT,  // FX07
+        SET_DT,  // FX15
+        SET_ST,  // FX18
+    };
+
+    // decoded instruction at an address, checked against memory before use
+    struct Op
+    {
+        uint16_t opcode;
+        bool valid;
+        bool clean; // decoded from a lane that never wrote memory
+        bool writes; // FX33, FX55 or 5XY2, may rewrite code
+        uint8_t kind;
+        Chip8::Instruction ins;
+    };
+
+    alignas(32) uint8_t V[16][LANES]; // V[register][lane]
+    alignas(32) uint16_t I[LANES];
+    alignas(32) uint16_t PC[LANES];
+    alignas(32) uint8_t delay[LANES];
+    alignas(32) uint8_t sound[LANES];
+    alignas(32) uint32_t remaining[LANES]; // instructions left in this Run
+
+    Chip8 *machines[LANES];
+    int count;
+    uint32_t dirty; // lanes that wrote to memory, their code may differ from the others
+    Op ops[4096];
+
+    void Load();  // machines -> lanes
+    void Store(); // lanes -> machines
+    uint32_t Group(uint32_t active, uint16_t &pc); // lanes that run next and their PC
+    uint32_t Finished(uint32_t mask);              // lanes in mask with no budget left
+    const Op &Fetch(int leader, uint16_t pc);
+    void Steps(uint32_t chunk); // every active lane executes chunk instructions
+    void Vector(const Op &op, uint32_t mask);
+    void Scalar(const Op &op, uint32_t mask);
+};
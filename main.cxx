@@ -1,5 +1,12 @@
 #include "SDL/include/SDL2/SDL.h"
 #include "chip8.h"
+#include "rewind.h"
+#include "inputlog.h"
+#include "audio.h"
+#include "triplebuffer.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 
 using namespace std;
 
@@ -23,16 +30,325 @@ uint8_t keymap[16] = {
     SDLK_v,
 };
 
+// sleep until the performance counter reaches deadline
+// SDL_Delay is only good to a millisecond or so, spin for the last bit
+void WaitUntil(Uint64 deadline)
+{
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    while (true)
+    {
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now >= deadline)
+            return;
+        Uint64 ms = (deadline - now) * 1000 / freq;
+        if (ms > 2)
+            SDL_Delay(ms - 2);
+    }
+}
+
+// SDL's audio thread, takes whatever the emulation thread has made so far
+static void AudioCallback(void *userdata, Uint8 *stream, int len)
+{
+    ((Chip8Audio *)userdata)->Pull((int16_t *)stream, len / sizeof(int16_t));
+}
+
+// one finished frame on its way from the emulation thread to the screen
+struct Frame
+{
+    uint64_t video[Chip8State::PLANES][64][2];
+    bool hires;
+    Uint64 inputTime; // performance counter of the key event this frame answers, 0 if none
+};
+
+// hotkeys the render thread passes on, each bit is picked up once
+enum Command
+{
+    COMMAND_RELOAD = 1, // F1
+    COMMAND_SAVE = 2,   // F5
+    COMMAND_LOAD = 4,   // F7
+};
+
+// everything both threads touch, each field has one writer
+// the render thread polls SDL and draws, the emulation thread owns the Chip8
+struct Shared
+{
+    // render -> emulation
+    atomic<uint16_t> keys{0};   // one bit per CHIP-8 key
+    atomic<Uint64> keyTime{0};  // when keys last changed, stored before keys
+    atomic<uint32_t> commands{0};
+    atomic<bool> rewinding{false};
+    atomic<bool> turbo{false};
+    atomic<int> turboSpeed{0};  // emulated frames per host frame, 0 runs as many as fit in one
+    atomic<bool> quit{false};
+
+    // emulation -> render
+    TripleBuffer<Frame> frames;
+
+    // lets the emulation thread sleep while the ROM waits for a key, the render
+    // thread never waits on this, it takes the lock once after a change and before
+    // notifying so the change can't land between the predicate check and the sleep
+    mutex wakeLock;
+    condition_variable wake;
+};
+
+// emulation thread state, the render thread only looks at it before start and after join
+struct Session
+{
+    Chip8 chip8;
+    Chip8InputLog log;
+    char *romPath;
+    const char *recordPath = NULL;
+    const char *replayPath = NULL;
+    const char *statsPath = NULL; // counters written on exit and on SIGUSR1, needs CHIP8_STATS
+    Chip8Audio *audio = NULL;     // NULL without a sound device
+};
+
+static void Emulate(Session &session, Shared &shared)
+{
+    Chip8 &chip8 = session.chip8;
+    Chip8InputLog &log = session.log;
+    bool replaying = session.replayPath != NULL;
+    bool recording = session.recordPath != NULL;
+
+    // a recording or replay only holds up if frames run straight through
+    bool logging = recording || replaying;
+
+    // save state slot and rewind history, hold backspace to rewind
+    Chip8State saved;
+    bool haveSaved = false;
+    Chip8Rewind rewind;
+
+    // 60 Hz frame clock
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    uint64_t frame = 0;
+
+    uint16_t keys = 0;    // key bits applied to the machine
+    Uint64 inputTime = 0; // key change not yet answered by a published frame
+
+    if (recording)
+        log.Start(chip8);
+
+    while (!shared.quit.load())
+    {
+        uint32_t commands = shared.commands.exchange(0);
+        if (commands & COMMAND_RELOAD)
+        {
+            // ROM is cached, this only copies its power on image back
+            if (replaying)
+                log.Restart(chip8);
+            chip8.ResetCPU(session.romPath);
+            if (recording)
+                log.Start(chip8);
+            rewind.Reset();
+            keys = 0;
+            start = SDL_GetPerformanceCounter();
+            frame = 0;
+        }
+        if (commands & COMMAND_SAVE)
+        {
+            chip8.SaveState(saved);
+            haveSaved = true;
+        }
+        if ((commands & COMMAND_LOAD) && haveSaved && !logging)
+        {
+            chip8.LoadState(saved);
+            keys = 0; // the state's keys are put right before the next frame runs
+        }
+
+        bool rewinding = shared.rewinding.load() && !logging;
+        bool turbo = shared.turbo.load();
+
+        // normally one emulated frame per host frame, fast forward runs several and
+        // only the last one gets drawn, timers still tick once per emulated frame
+        int frames = turbo ? shared.turboSpeed.load() : 1;
+        Uint64 busyUntil = SDL_GetPerformanceCounter() + freq / 60;
+        for (int n = 0; frames == 0 || n < frames; n++)
+        {
+            // unlimited speed stops once the host frame is used up, clock read every 64 frames
+            if (frames == 0 && (n & 63) == 0 && n > 0 && SDL_GetPerformanceCounter() >= busyUntil)
+                break;
+
+            if (rewinding)
+            {
+                // step back a frame, stays put once history runs out
+                // live keys go back in before the next frame runs
+                rewind.Rewind(chip8);
+                keys = 0;
+                continue;
+            }
+
+            // input for this frame comes from the log when replaying, from the keyboard otherwise
+            if (replaying)
+            {
+                log.Replay(chip8);
+            }
+            else
+            {
+                uint16_t now = shared.keys.load();
+                if (now != keys)
+                    inputTime = shared.keyTime.load();
+                keys = now;
+                for (int i = 0; i < 16; i++)
+                    chip8.inputKeys[i] = (keys >> i) & 1;
+            }
+            if (recording)
+                log.Record(chip8);
+
+            // run one frame worth of instructions, timers tick once
+            chip8.RunFrame();
+            rewind.Push(chip8);
+        }
+
+        // one frame of sound per host frame, fast forward plays the last emulated frame's
+        if (session.audio != NULL)
+            session.audio->Frame(chip8);
+
+#ifdef CHIP8_STATS
+        if (session.statsPath != NULL && Chip8Stats::Requested())
+            chip8.stats.Write(session.statsPath);
+#endif
+
+        // hand the screen over, nothing to do if no pixel changed
+        if (chip8.videoDirty)
+        {
+            Frame &out = shared.frames.Back();
+            memcpy(out.video, chip8.video, sizeof(out.video));
+            out.hires = chip8.hires != 0;
+            out.inputTime = inputTime;
+            shared.frames.Publish();
+            chip8.ClearDirty();
+            inputTime = 0;
+        }
+
+        // waiting for a key (or stopped on a jump to itself) with both timers out, frames
+        // change nothing, so stop running them until something happens
+        // a replay has no keyboard to wait for, it keeps going
+        if (chip8.idleLoop == 1 && chip8.delayTimer == 0 && chip8.soundTimer == 0 &&
+            !rewinding && !turbo && !replaying)
+        {
+            if (session.audio != NULL)
+                session.audio->Pause(); // silent anyway, the device running dry is expected
+            unique_lock<mutex> lock(shared.wakeLock);
+            shared.wake.wait_for(lock, chrono::milliseconds(100), [&]()
+                                 { return shared.keys.load() != keys || shared.commands.load() != 0 ||
+                                          shared.rewinding.load() || shared.turbo.load() || shared.quit.load(); });
+            start = SDL_GetPerformanceCounter();
+            frame = 0;
+            continue;
+        }
+
+        // Sleep until the next frame is due
+        frame++;
+        Uint64 deadline = start + frame * freq / 60;
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now > deadline + freq / 10)
+        {
+            // fell far behind (debugger, host under load...), don't try to catch up
+            start = now;
+            frame = 0;
+        }
+        else if (chip8.idleLoop != 0 && !turbo && !replaying)
+        {
+            // ROM is only polling a timer or the keys, no need for exact timing,
+            // sleep without spinning and wake up early if a key comes in
+            unique_lock<mutex> lock(shared.wakeLock);
+            shared.wake.wait_for(lock, chrono::microseconds((deadline - now) * 1000000 / freq), [&]()
+                                 { return shared.keys.load() != keys || shared.quit.load(); });
+        }
+        else
+        {
+            WaitUntil(deadline);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     // Command usage
-    if (argc != 2)
+    if (argc < 2)
+    {
+        cout << "Usage: chip8 <ROM file> [instructions per frame] [-s seed] [-r record.log | -p replay.log] [-t 2 | 8 | max] [-S stats.json | stats.csv] [-a audio buffer samples, 0 for no sound] [-q default|vip|chip48|schip|xochip]" << endl;
+        return 1;
+    }
+
+    Session *session = new Session();
+    Chip8 &chip8 = session->chip8;
+    chip8.seed = random_device()(); // a different game every time unless asked otherwise
+    session->romPath = argv[1];
+
+    Shared shared;
+    int audioBuffer = 512; // samples per SDL callback, smaller is lower latency but more likely to run dry
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+        {
+            chip8.instructionsPerFrame = atoi(argv[i]);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "-s") == 0)
+            chip8.seed = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-r") == 0)
+            session->recordPath = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0)
+            session->replayPath = argv[++i];
+        else if (strcmp(argv[i], "-S") == 0)
+            session->statsPath = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0)
+            audioBuffer = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            const Chip8Quirks *quirks = Chip8::FindQuirks(argv[++i]);
+            if (quirks == NULL)
+            {
+                cout << "Unknown quirk profile " << argv[i] << endl;
+                return 1;
+            }
+            chip8.SetQuirks(*quirks); // a replayed log brings its own
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            i++;
+            shared.turboSpeed = strcmp(argv[i], "max") == 0 ? 0 : max(atoi(argv[i]), 1);
+            shared.turbo = true;
+        }
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if (session->replayPath != NULL)
+    {
+        if (!session->log.Load(session->replayPath))
+        {
+            cout << "Could not read input log " << session->replayPath << endl;
+            return 1;
+        }
+        session->log.Restart(chip8);
+    }
+#ifndef CHIP8_STATS
+    if (session->statsPath != NULL)
     {
-        cout << "Usage: chip8 <ROM file>" << endl;
+        cout << "Built without CHIP8_STATS, no counters to write" << endl;
         return 1;
     }
+#else
+    Chip8Stats::CatchSignal();
+#endif
 
-    Chip8 chip8 = Chip8(); // Initialise Chip8
+    // Attempt to load ROM
+    if (!chip8.ResetCPU(argv[1]))
+    {
+        cout << "Could not load " << argv[1] << ", missing, empty or over 3584 bytes" << endl;
+        return 1;
+    }
 
     int w = 1024; // Window width
     int h = 512;  // Window height
@@ -46,6 +362,34 @@ int main(int argc, char **argv)
         printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
         exit(1);
     }
+
+    // Open the sound device, carry on without sound if there isn't one
+    SDL_AudioDeviceID audioDevice = 0;
+    if (audioBuffer > 0)
+    {
+        SDL_AudioSpec want, have;
+        memset(&want, 0, sizeof(want));
+        want.freq = 44100;
+        want.format = AUDIO_S16SYS;
+        want.channels = 1;
+        want.samples = audioBuffer;
+        want.callback = AudioCallback;
+        // room for a device buffer being played, one being filled and a couple of frames
+        session->audio = new Chip8Audio(want.freq, 2 * audioBuffer + want.freq / 30);
+        want.userdata = session->audio;
+        audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+        if (audioDevice == 0)
+        {
+            printf("No sound, SDL_Error: %s\n", SDL_GetError());
+            delete session->audio;
+            session->audio = NULL;
+        }
+        else
+        {
+            SDL_PauseAudioDevice(audioDevice, 0);
+        }
+    }
+
     // Create window
     window = SDL_CreateWindow(
         "CHIP-8 Emulator",
@@ -58,83 +402,180 @@ int main(int argc, char **argv)
         exit(2);
     }
 
-    // Create renderer
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
+    // Create renderer, presenting waits for vsync, that only holds up this thread
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
     SDL_RenderSetLogicalSize(renderer, w, h);
 
-    // Create texture that stores frame buffer
+    // Create texture that stores frame buffer, big enough for high-res, low-res uses its top left corner
+    // so switching modes never reallocates anything
     SDL_Texture *sdlTexture = SDL_CreateTexture(renderer,
                                                 SDL_PIXELFORMAT_ARGB8888,
                                                 SDL_TEXTUREACCESS_STREAMING,
-                                                64, 32);
+                                                128, 64);
+
+    // pixel colour for each combination of the two planes, plain CHIP-8 only uses the first two
+    const uint32_t palette[4] = {0xFF000000, 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555};
 
     // Temporary pixel buffer
-    uint32_t pixels[2048];
+    uint32_t pixels[128 * 64];
+    uint64_t shown[Chip8State::PLANES][64][2]; // rows as last drawn
+    bool shownHires = false;
+    bool fresh = true; // nothing drawn yet, first frame updates every row
 
-load:
-    // Attempt to load ROM
-    chip8.ResetCPU(argv[1]);
+    // input to screen latency, from a key event to the present of the first frame that changed after it
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    uint64_t latencySamples = 0;
+    double latencyTotal = 0, latencyMax = 0;
+
+    thread emulation(Emulate, ref(*session), ref(shared));
 
-    // Emulation loop
+    // Render loop, events in, frames out, never waits on the emulation thread
     while (true)
     {
-        chip8.Cycle();
-
         // Process SDL events
+        bool wake = false;
         SDL_Event e;
         while (SDL_PollEvent(&e))
         {
             if (e.type == SDL_QUIT)
-                exit(0);
+                goto quit;
 
             // Process keydown events
             if (e.type == SDL_KEYDOWN)
             {
                 if (e.key.keysym.sym == SDLK_ESCAPE)
-                    exit(0);
+                    goto quit;
 
                 if (e.key.keysym.sym == SDLK_F1)
-                    goto load; // *gasp*, a goto statement!
-                               // Used to reset/reload ROM
+                    shared.commands |= COMMAND_RELOAD; // Used to reset/reload ROM
+                if (e.key.keysym.sym == SDLK_F5)
+                    shared.commands |= COMMAND_SAVE;
+                if (e.key.keysym.sym == SDLK_F7)
+                    shared.commands |= COMMAND_LOAD;
+
+                // tab toggles fast forward, F2 picks its speed
+                if (e.key.keysym.sym == SDLK_TAB)
+                    shared.turbo = !shared.turbo;
+                if (e.key.keysym.sym == SDLK_F2)
+                {
+                    int speed = shared.turboSpeed;
+                    shared.turboSpeed = speed == 2 ? 8 : speed == 8 ? 0 : 2;
+                }
+                if (e.key.keysym.sym == SDLK_BACKSPACE)
+                    shared.rewinding = true;
 
                 for (int i = 0; i < 16; ++i)
                 {
                     if (e.key.keysym.sym == keymap[i])
                     {
-                        chip8.inputKeys[i] = 1;
+                        shared.keyTime = SDL_GetPerformanceCounter();
+                        shared.keys |= 1 << i;
                     }
                 }
+                wake = true;
             }
             // Process keyup events
             if (e.type == SDL_KEYUP)
             {
+                if (e.key.keysym.sym == SDLK_BACKSPACE)
+                    shared.rewinding = false;
+
                 for (int i = 0; i < 16; ++i)
                 {
                     if (e.key.keysym.sym == keymap[i])
                     {
-                        chip8.inputKeys[i] = 0;
+                        shared.keyTime = SDL_GetPerformanceCounter();
+                        shared.keys &= ~(1 << i);
                     }
                 }
+                wake = true;
             }
         }
+        if (wake)
+        {
+            { lock_guard<mutex> guard(shared.wakeLock); }
+            shared.wake.notify_one();
+        }
 
-        // redraw SDL screen
-        // Store pixels in temporary buffer
-        for (int j = 0; j < 32; ++j)
+        // nothing new from the emulation thread, wait for an event or the next check
+        if (!shared.frames.Update())
         {
-            for (int i = 0; i < 64; ++i)
+            SDL_WaitEventTimeout(NULL, 2);
+            continue;
+        }
+        const Frame &f = shared.frames.Front();
+
+        // redraw SDL screen, only rows that differ from what is up already, every row after a mode switch
+        int width = f.hires ? 128 : 64;
+        int height = f.hires ? 64 : 32;
+        bool all = fresh || f.hires != shownHires;
+        fresh = false;
+        shownHires = f.hires;
+        int top = 64, bottom = -1;
+        for (int j = 0; j < height; ++j)
+        {
+            if (!all && memcmp(f.video[0][j], shown[0][j], sizeof(shown[0][j])) == 0 &&
+                memcmp(f.video[1][j], shown[1][j], sizeof(shown[1][j])) == 0)
+                continue;
+            if (top > j)
+                top = j;
+            bottom = j;
+
+            // Store changed rows in temporary buffer
+            for (int p = 0; p < Chip8State::PLANES; p++)
+                memcpy(shown[p][j], f.video[p][j], sizeof(shown[p][j]));
+            for (int i = 0; i < width; ++i)
             {
-                uint32_t pixel = chip8.video[i][j];
-                pixels[(j * 64) + i] = (0x00FFFFFF * pixel) | 0xFF000000;
+                int half = i >> 6, bit = 63 - (i & 63);
+                int color = ((f.video[0][j][half] >> bit) & 1) | (((f.video[1][j][half] >> bit) & 1) << 1);
+                pixels[(j * 128) + i] = palette[color];
             }
-        } // Update SDL texture
-        SDL_UpdateTexture(sdlTexture, NULL, pixels, 64 * sizeof(Uint32));
+        }
+        if (bottom < 0)
+            continue; // drawn and undrawn within a frame, nothing visible changed
+
+        // Update only those rows of the SDL texture
+        SDL_Rect rows = {0, top, width, bottom - top + 1};
+        SDL_UpdateTexture(sdlTexture, &rows, &pixels[top * 128], 128 * sizeof(Uint32));
+        SDL_Rect screen = {0, 0, width, height};
         // Clear screen and render
         SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, sdlTexture, NULL, NULL);
+        SDL_RenderCopy(renderer, sdlTexture, &screen, NULL);
         SDL_RenderPresent(renderer);
 
-        // Sleep to slow down emulation speed
-        SDL_Delay(2);
+        if (f.inputTime != 0)
+        {
+            double ms = (SDL_GetPerformanceCounter() - f.inputTime) * 1000.0 / freq;
+            latencySamples++;
+            latencyTotal += ms;
+            latencyMax = max(latencyMax, ms);
+        }
+    }
+
+quit:
+    shared.quit = true;
+    { lock_guard<mutex> guard(shared.wakeLock); }
+    shared.wake.notify_one();
+    emulation.join();
+    if (audioDevice != 0)
+    {
+        SDL_CloseAudioDevice(audioDevice);
+        printf("audio: %llu underruns, %llu overruns (samples)\n",
+               (unsigned long long)session->audio->Underruns(), (unsigned long long)session->audio->Overruns());
+    }
+
+    if (latencySamples > 0)
+        printf("input latency: %llu samples, %.2f ms average, %.2f ms worst\n",
+               (unsigned long long)latencySamples, latencyTotal / latencySamples, latencyMax);
+
+#ifdef CHIP8_STATS
+    if (session->statsPath != NULL && !chip8.stats.Write(session->statsPath))
+        cout << "Could not write " << session->statsPath << endl;
+#endif
+    if (session->recordPath != NULL && !session->log.Save(session->recordPath))
+    {
+        cout << "Could not write input log " << session->recordPath << endl;
+        return 1;
     }
-}
\ No newline at end of file
+    return 0;
+}
@@ -0,0 +1,362 @@
+#include "chip8.h"
+#include <set>
+#include <map>
+#include <string>
+
+using namespace std;
+
+// static recompiler, follows the ROM's control flow from START_ADDRESS (jumps, calls and the
+// instructions after them, both sides of every skip) and writes a C++ file with one function
+// per basic block, compile that file into a program with libchip8 and Chip8Aot runs it
+// returns and BNNN jump somewhere only known at run time, the runtime looks the target up and
+// interprets it if no block starts or runs through there, same for code the ROM rewrites
+
+static const int MAX_BLOCK = 64; // instructions per block
+
+struct Block
+{
+    uint16_t start;
+    vector<uint16_t> pcs;
+};
+
+static uint16_t Opcode(const Chip8 &chip8, int pc)
+{
+    return (chip8.memory[pc] << 8) | chip8.memory[pc + 1];
+}
+
+// instructions after which PC isn't simply the next instruction, or that may have
+// rewritten code, or set idleLoop
+static bool EndsBlock(const char *name)
+{
+    static const char *enders[] = {"1NNN", "2NNN", "00EE", "BNNN", "3XNN", "4XNN", "5XY0", "9XY0",
+                                   "EX9E", "EXA1", "FX0A", "00FD", "FX33", "FX55", "5XY2"};
+    for (size_t i = 0; i < sizeof(enders) / sizeof(enders[0]); i++)
+    {
+        if (strcmp(enders[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// addresses execution can go to from pc that are known before it runs
+static vector<int> Successors(const Chip8 &chip8, int pc)
+{
+    uint16_t opcode = Opcode(chip8, pc);
+    const char *name = Chip8::OpcodeName(opcode);
+    vector<int> next;
+    if (strcmp(name, "1NNN") == 0)
+        next.push_back(opcode & 0x0FFF);
+    else if (strcmp(name, "2NNN") == 0)
+        next.push_back(opcode & 0x0FFF), next.push_back(pc + 2);
+    else if (strcmp(name, "3XNN") == 0 || strcmp(name, "4XNN") == 0 || strcmp(name, "5XY0") == 0 ||
+             strcmp(name, "9XY0") == 0 || strcmp(name, "EX9E") == 0 || strcmp(name, "EXA1") == 0)
+        next.push_back(pc + 2), next.push_back(pc + 4);
+    else if (strcmp(name, "00EE") != 0 && strcmp(name, "BNNN") != 0 && strcmp(name, "00FD") != 0)
+        next.push_back(pc + 2);
+    return next;
+}
+
+// C++ for an instruction that runs inline, empty if it goes to its interpreter handler
+static string Inline(uint16_t opcode, const char *name, const Chip8Quirks &q)
+{
+    char buf[256];
+    int x = (opcode >> 8) & 0xF;
+    int y = (opcode >> 4) & 0xF;
+    int nn = opcode & 0xFF;
+    int nnn = opcode & 0xFFF;
+    int shifted = q.shiftVY ? y : x;
+
+    buf[0] = 0;
+    if (strcmp(name, "6XNN") == 0)
+        snprintf(buf, sizeof(buf), "c.registers[0x%X] = 0x%02X;", x, nn);
+    else if (strcmp(name, "7XNN") == 0)
+        snprintf(buf, sizeof(buf), "c.registers[0x%X] += 0x%02X;", x, nn);
+    else if (strcmp(name, "8XY0") == 0)
+        snprintf(buf, sizeof(buf), "c.registers[0x%X] = c.registers[0x%X];", x, y);
+    else if (strcmp(name, "8XY1") == 0 || strcmp(name, "8XY2") == 0 || strcmp(name, "8XY3") == 0)
+        snprintf(buf, sizeof(buf), "c.registers[0x%X] %c= c.registers[0x%X];%s", x, "|&^"[(opcode & 0xF) - 1], y,
+                 q.logicResetsVF ? " c.registers[0xF] = 0;" : "");
+    else if (strcmp(name, "8XY4") == 0)
+        snprintf(buf, sizeof(buf), "{ int sum = c.registers[0x%X] + c.registers[0x%X]; c.registers[0x%X] = sum; c.registers[0xF] = sum > 255; }",
+                 x, y, x);
+    else if (strcmp(name, "8XY5") == 0)
+        snprintf(buf, sizeof(buf), "{ int vx = c.registers[0x%X], vy = c.registers[0x%X]; c.registers[0x%X] = vx - vy; c.registers[0xF] = vy > vx ? 0 : 1; }",
+                 x, y, x);
+    else if (strcmp(name, "8XY7") == 0)
+        snprintf(buf, sizeof(buf), "{ int vx = c.registers[0x%X], vy = c.registers[0x%X]; c.registers[0x%X] = vy - vx; c.registers[0xF] = vx > vy ? 0 : 1; }",
+                 x, y, x);
+    else if (strcmp(name, "8XY6") == 0)
+        snprintf(buf, sizeof(buf), "{ uint8_t v = c.registers[0x%X]; c.registers[0x%X] = v >> 1; c.registers[0xF] = v & 0x1; }", shifted, x);
+    else if (strcmp(name, "8XYE") == 0)
+        snprintf(buf, sizeof(buf), "{ uint8_t v = c.registers[0x%X]; c.registers[0x%X] = v << 1; c.registers[0xF] = v >> 7; }", shifted, x);
+    else if (strcmp(name, "ANNN") == 0)
+        snprintf(buf, sizeof(buf), "c.indexRegister = 0x%03X;", nnn);
+    else if (strcmp(name, "CXNN") == 0)
+        snprintf(buf, sizeof(buf), "c.registers[0x%X] = c.Random() & 0x%02X;", x, nn);
+    else if (strcmp(name, "FX07") == 0)
+        snprintf(buf, sizeof(buf), "c.registers[0x%X] = c.delayTimer;", x);
+    else if (strcmp(name, "FX15") == 0)
+        snprintf(buf, sizeof(buf), "c.delayTimer = c.registers[0x%X];", x);
+    else if (strcmp(name, "FX18") == 0)
+        snprintf(buf, sizeof(buf), "c.soundTimer = c.registers[0x%X];", x);
+    else if (strcmp(name, "FX1E") == 0)
+        snprintf(buf, sizeof(buf), "c.indexRegister += c.registers[0x%X];", x);
+    else if (strcmp(name, "FX29") == 0)
+        snprintf(buf, sizeof(buf), "c.indexRegister = 0x50 + c.registers[0x%X] * 5;", x);
+    else if (strcmp(name, "NONE") == 0)
+        snprintf(buf, sizeof(buf), "// not an instruction, does nothing");
+    return buf;
+}
+
+// C++ for a control transfer, sets PC itself, empty if it goes to its interpreter handler
+static string Branch(uint16_t opcode, const char *name, int pc, const Chip8Quirks &q)
+{
+    char buf[256];
+    int x = (opcode >> 8) & 0xF;
+    int y = (opcode >> 4) & 0xF;
+    int nn = opcode & 0xFF;
+    int nnn = opcode & 0xFFF;
+
+    buf[0] = 0;
+    if (strcmp(name, "1NNN") == 0)
+    {
+        // the interpreter's idle loop checks, so Run ends up skipping the same passes
+        if (nnn == pc)
+            snprintf(buf, sizeof(buf), "c.idleLoop = 1; c.programCounter = 0x%03X;", nnn);
+        else if (nnn == pc - 4)
+            snprintf(buf, sizeof(buf), "if (c.TimerPoll(0x%03X))\n            c.idleLoop = 3;\n        c.programCounter = 0x%03X;", nnn, nnn);
+        else
+            snprintf(buf, sizeof(buf), "c.programCounter = 0x%03X;", nnn);
+    }
+    else if (strcmp(name, "2NNN") == 0)
+        snprintf(buf, sizeof(buf),
+                 "if (c.stackSize == 16) { c.programCounter = 0x%03X; c.opcode = 0x%04X; c.Halt(Chip8State::FAULT_STACK_OVERFLOW); return n + 1; }\n"
+                 "        c.stack[c.stackSize++] = 0x%03X; c.programCounter = 0x%03X;",
+                 pc + 2, opcode, pc + 2, nnn);
+    else if (strcmp(name, "00EE") == 0)
+        snprintf(buf, sizeof(buf),
+                 "if (c.stackSize == 0) { c.programCounter = 0x%03X; c.opcode = 0x%04X; c.Halt(Chip8State::FAULT_STACK_UNDERFLOW); return n + 1; }\n"
+                 "        c.programCounter = c.stack[--c.stackSize];",
+                 pc + 2, opcode);
+    else if (strcmp(name, "BNNN") == 0)
+        snprintf(buf, sizeof(buf), "c.programCounter = c.registers[0x%X] + 0x%03X;", q.jumpVX ? x : 0, nnn);
+    else if (strcmp(name, "3XNN") == 0)
+        snprintf(buf, sizeof(buf), "c.programCounter = c.registers[0x%X] == 0x%02X ? 0x%03X : 0x%03X;", x, nn, pc + 4, pc + 2);
+    else if (strcmp(name, "4XNN") == 0)
+        snprintf(buf, sizeof(buf), "c.programCounter = c.registers[0x%X] != 0x%02X ? 0x%03X : 0x%03X;", x, nn, pc + 4, pc + 2);
+    else if (strcmp(name, "5XY0") == 0)
+        snprintf(buf, sizeof(buf), "c.programCounter = c.registers[0x%X] == c.registers[0x%X] ? 0x%03X : 0x%03X;", x, y, pc + 4, pc + 2);
+    else if (strcmp(name, "9XY0") == 0)
+        snprintf(buf, sizeof(buf), "c.programCounter = c.registers[0x%X] != c.registers[0x%X] ? 0x%03X : 0x%03X;", x, y, pc + 4, pc + 2);
+    else if (strcmp(name, "EX9E") == 0)
+        snprintf(buf, sizeof(buf), "c.programCounter = c.inputKeys[c.registers[0x%X] & 0xF] ? 0x%03X : 0x%03X;", x, pc + 4, pc + 2);
+    else if (strcmp(name, "EXA1") == 0)
+        snprintf(buf, sizeof(buf), "c.programCounter = !c.inputKeys[c.registers[0x%X] & 0xF] ? 0x%03X : 0x%03X;", x, pc + 4, pc + 2);
+    return buf;
+}
+
+static string Escape(const char *s)
+{
+    string out;
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            out += '\\';
+        out += *s;
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    // Command usage
+    if (argc < 2)
+    {
+        cout << "Usage: chip8-recompile <ROM file> [-o out.cxx] [-q default|vip|chip48|schip|xochip]" << endl;
+        return 1;
+    }
+
+    const char *outPath = NULL;
+    const Chip8Quirks *quirks = &QUIRKS_DEFAULT;
+    for (int i = 2; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "-o") == 0)
+            outPath = argv[++i];
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            quirks = Chip8::FindQuirks(argv[++i]);
+            if (quirks == NULL)
+            {
+                cout << "Unknown quirk profile " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    // memory exactly as it is at power on, font included
+    Chip8 *chip8 = new Chip8();
+    if (!chip8->ResetCPU(argv[1]))
+    {
+        cout << "Could not load " << argv[1] << endl;
+        return 1;
+    }
+    int romSize = 0;
+    for (int i = Chip8State::START_ADDRESS; i < 4096; i++)
+    {
+        if (chip8->memory[i] != 0)
+            romSize = i + 1 - Chip8State::START_ADDRESS; // trailing zeros can't tell ROMs apart anyway
+    }
+
+    // every address reachable without knowing register values, instructions wholly inside memory only
+    set<int> reachable;
+    vector<int> work = {Chip8State::START_ADDRESS};
+    while (!work.empty())
+    {
+        int pc = work.back();
+        work.pop_back();
+        if (pc + 1 > 0xFFF || !reachable.insert(pc).second)
+            continue;
+        vector<int> next = Successors(*chip8, pc);
+        work.insert(work.end(), next.begin(), next.end());
+    }
+
+    // straight runs of reachable instructions, ended by anything that may not go on to the next one
+    vector<Block> blocks;
+    set<int> claimed;
+    for (set<int>::iterator it = reachable.begin(); it != reachable.end(); ++it)
+    {
+        if (claimed.count(*it))
+            continue;
+        Block b;
+        b.start = *it;
+        for (int pc = *it; reachable.count(pc) && !claimed.count(pc) && (int)b.pcs.size() < MAX_BLOCK; pc += 2)
+        {
+            b.pcs.push_back(pc);
+            claimed.insert(pc);
+            if (EndsBlock(Chip8::OpcodeName(Opcode(*chip8, pc))))
+                break;
+        }
+        blocks.push_back(b);
+    }
+
+    FILE *out = outPath != NULL ? fopen(outPath, "w") : stdout;
+    if (out == NULL)
+    {
+        cout << "Could not open " << outPath << endl;
+        return 1;
+    }
+
+    const char *base = strrchr(argv[1], '/') != NULL ? strrchr(argv[1], '/') + 1 : argv[1];
+    fprintf(out, "// generated by chip8-recompile from %s, %s quirks, do not edit\n", base, quirks->name);
+    fprintf(out, "// compile it into a program with libchip8, Chip8Aot::Find picks it for this ROM\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+
+    fprintf(out, "// memory the blocks were compiled from\n");
+    fprintf(out, "static const uint8_t image[4096] = {\n");
+    for (int i = 0; i < 4096; i += 16)
+    {
+        fprintf(out, "   ");
+        for (int j = 0; j < 16; j++)
+            fprintf(out, " 0x%02X,", chip8->memory[i + j]);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "};\n\n");
+
+    // instructions left to their handlers, numbered in order of appearance
+    map<uint16_t, int> calls;
+    vector<uint16_t> callOpcodes;
+    for (size_t b = 0; b < blocks.size(); b++)
+    {
+        for (size_t i = 0; i < blocks[b].pcs.size(); i++)
+        {
+            int pc = blocks[b].pcs[i];
+            uint16_t opcode = Opcode(*chip8, pc);
+            const char *name = Chip8::OpcodeName(opcode);
+            if (Inline(opcode, name, *quirks).empty() && Branch(opcode, name, pc, *quirks).empty() && !calls.count(opcode))
+            {
+                calls[opcode] = callOpcodes.size();
+                callOpcodes.push_back(opcode);
+            }
+        }
+    }
+    fprintf(out, "// instructions the blocks hand to interpreter handlers, decoded by Chip8Aot\n");
+    fprintf(out, "static const uint16_t opcodes[%zu] = {", max<size_t>(callOpcodes.size(), 1));
+    for (size_t i = 0; i < callOpcodes.size(); i++)
+        fprintf(out, "%s0x%04X,", i % 12 == 0 ? "\n    " : " ", callOpcodes[i]);
+    fprintf(out, "%s};\n", callOpcodes.empty() ? "0" : "\n");
+    fprintf(out, "static Chip8::Instruction ops[%zu];\n\n", max<size_t>(callOpcodes.size(), 1));
+
+    fprintf(out, "// stop after this instruction if that was the last one the budget allows\n");
+    fprintf(out, "#define STEP(next, op) if (++n == budget) { c.programCounter = next; c.opcode = op; return n; } [[fallthrough]]\n");
+    fprintf(out, "// hand an instruction to its handler, PC already past it the way Chip8::Run leaves it\n");
+    fprintf(out, "#define CALL(k, next) c.programCounter = next; c.opcode = opcodes[k]; ops[k].handler(c, ops[k])\n\n");
+
+    for (size_t b = 0; b < blocks.size(); b++)
+    {
+        const Block &block = blocks[b];
+        // one instruction blocks never run out of budget part way
+        fprintf(out, "static int B%03X(Chip8 &c, int entry, int%s)\n{\n", block.start, block.pcs.size() > 1 ? " budget" : "");
+        fprintf(out, "    int n = 0;\n    switch (entry)\n    {\n");
+        for (size_t i = 0; i < block.pcs.size(); i++)
+        {
+            int pc = block.pcs[i];
+            uint16_t opcode = Opcode(*chip8, pc);
+            const char *name = Chip8::OpcodeName(opcode);
+            bool last = i + 1 == block.pcs.size();
+            string code = Inline(opcode, name, *quirks);
+            string branch = Branch(opcode, name, pc, *quirks);
+
+            fprintf(out, "    case %zu: // %03X: %04X %s\n", i, pc, opcode, name);
+            if (!branch.empty())
+            {
+                fprintf(out, "        %s\n", branch.c_str());
+                fprintf(out, "        c.opcode = 0x%04X;\n        return n + 1;\n", opcode);
+                continue;
+            }
+            if (!code.empty())
+                fprintf(out, "        %s\n", code.c_str());
+            else
+                fprintf(out, "        CALL(%d, 0x%03X);\n", calls[opcode], pc + 2);
+
+            // the handler moved PC itself or may have rewritten code, back to the runtime
+            if (code.empty() && EndsBlock(name))
+                fprintf(out, "        return n + 1;\n");
+            else if (last)
+                fprintf(out, "        c.programCounter = 0x%03X;\n        c.opcode = 0x%04X;\n        return n + 1;\n", pc + 2, opcode);
+            else
+                fprintf(out, "        STEP(0x%03X, 0x%04X);\n", pc + 2, opcode);
+        }
+        fprintf(out, "    }\n    return n;\n}\n\n");
+    }
+
+    fprintf(out, "static const Chip8AotBlock blocks[%zu] = {\n", max<size_t>(blocks.size(), 1));
+    for (size_t b = 0; b < blocks.size(); b++)
+        fprintf(out, "    {0x%03X, 0x%03X, B%03X},\n", blocks[b].start, blocks[b].pcs.back() + 2, blocks[b].start);
+    if (blocks.empty())
+        fprintf(out, "    {0, 0, NULL},\n");
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const Chip8AotModule module = {\"%s\", \"%s\", %d, image, blocks, %zu, opcodes, ops, %zu};\n",
+            Escape(base).c_str(), quirks->name, romSize, blocks.size(), callOpcodes.size());
+    fprintf(out, "static Chip8AotRegistration registration(&module);\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    size_t instructions = 0;
+    for (size_t b = 0; b < blocks.size(); b++)
+        instructions += blocks[b].pcs.size();
+    fprintf(stderr, "%zu instructions in %zu blocks, %zu handed to handlers\n", instructions, blocks.size(), callOpcodes.size());
+    delete chip8;
+    return 0;
+}
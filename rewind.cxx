@@ -0,0 +1,190 @@
+#include "rewind.h"
+#include <algorithm>
+
+static_assert(sizeof(Chip8State) % 8 == 0, "snapshot is diffed a word at a time");
+
+static uint64_t Word(const Chip8State &state, int i)
+{
+    uint64_t word;
+    memcpy(&word, (const uint8_t *)&state + i * 8, 8);
+    return word;
+}
+
+static void PutCount(std::vector<uint8_t> &out, size_t count)
+{
+    // 7 bits per byte, high bit set on all but the last
+    while (count >= 0x80)
+    {
+        out.push_back((count & 0x7F) | 0x80);
+        count >>= 7;
+    }
+    out.push_back(count);
+}
+
+static size_t GetCount(const uint8_t *&in)
+{
+    size_t count = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        uint8_t byte = *in++;
+        count |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return count;
+    }
+}
+
+Chip8Rewind::Chip8Rewind(size_t capacity)
+    : ring(capacity)
+{
+    // room for the worst delta, every word changed, so Push never allocates after this
+    delta.reserve(sizeof(Chip8State) + 16);
+    Reset();
+}
+
+void Chip8Rewind::Reset()
+{
+    head = 0;
+    used = 0;
+    frames = 0;
+    started = false;
+}
+
+size_t Chip8Rewind::Frames()
+{
+    return frames;
+}
+
+size_t Chip8Rewind::Used()
+{
+    return used;
+}
+
+// delta is a list of (unchanged words, changed words, XOR of each changed word)
+void Chip8Rewind::Encode(const Chip8State &from, const Chip8State &to)
+{
+    delta.clear();
+    int i = 0;
+    while (i < WORDS)
+    {
+        int skip = i;
+        while (i < WORDS && Word(from, i) == Word(to, i))
+            i++;
+        if (i == WORDS)
+            break; // nothing changed after this, no need to say so
+
+        int first = i;
+        while (i < WORDS && Word(from, i) != Word(to, i))
+            i++;
+
+        PutCount(delta, first - skip);
+        PutCount(delta, i - first);
+        for (int j = first; j < i; j++)
+        {
+            uint64_t change = Word(from, j) ^ Word(to, j);
+            const uint8_t *bytes = (const uint8_t *)&change;
+            delta.insert(delta.end(), bytes, bytes + 8);
+        }
+    }
+}
+
+// XOR is its own inverse, the delta that led here also leads back
+void Chip8Rewind::Apply(Chip8State &state)
+{
+    uint8_t *base = (uint8_t *)&state;
+    const uint8_t *in = delta.data();
+    const uint8_t *end = in + delta.size();
+    size_t i = 0;
+    while (in < end)
+    {
+        i += GetCount(in);
+        size_t changed = GetCount(in);
+        for (; changed > 0; changed--, i++, in += 8)
+        {
+            uint64_t word, change;
+            memcpy(&word, base + i * 8, 8);
+            memcpy(&change, in, 8);
+            word ^= change;
+            memcpy(base + i * 8, &word, 8);
+        }
+    }
+}
+
+void Chip8Rewind::Write(const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t first = std::min(size, ring.size() - head);
+    memcpy(&ring[head], bytes, first);
+    memcpy(&ring[0], bytes + first, size - first);
+    head = (head + size) % ring.size();
+}
+
+void Chip8Rewind::Read(size_t position, void *data, size_t size)
+{
+    uint8_t *bytes = (uint8_t *)data;
+    position %= ring.size();
+    size_t first = std::min(size, ring.size() - position);
+    memcpy(bytes, &ring[position], first);
+    memcpy(bytes + first, &ring[0], size - first);
+}
+
+void Chip8Rewind::DropOldest()
+{
+    uint32_t length;
+    Read(head + ring.size() - used, &length, sizeof(length));
+    used -= length + 2 * sizeof(length);
+    frames--;
+}
+
+void Chip8Rewind::Push(const Chip8 &chip8)
+{
+    if (!started)
+    {
+        chip8.SaveState(current);
+        started = true;
+        return;
+    }
+
+    chip8.SaveState(next);
+    Encode(current, next);
+    current = next;
+
+    uint32_t length = delta.size();
+    size_t size = length + 2 * sizeof(length);
+    if (size > ring.size())
+    {
+        Reset(); // can't hold even this one frame, history starts over
+        chip8.SaveState(current);
+        started = true;
+        return;
+    }
+    while (ring.size() - used < size)
+        DropOldest();
+
+    Write(&length, sizeof(length));
+    Write(delta.data(), length);
+    Write(&length, sizeof(length));
+    used += size;
+    frames++;
+}
+
+bool Chip8Rewind::Rewind(Chip8 &chip8)
+{
+    if (frames == 0)
+        return false;
+
+    // newest record ends at head, its length is stored at both ends
+    uint32_t length;
+    size_t end = head + ring.size();
+    Read(end - sizeof(length), &length, sizeof(length));
+    delta.resize(length);
+    Read(end - sizeof(length) - length, delta.data(), length);
+
+    size_t size = length + 2 * sizeof(length);
+    head = (end - size) % ring.size();
+    used -= size;
+    frames--;
+
+    Apply(current);
+    chip8.LoadState(current);
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "chip8.h"
+
+// history of the last few minutes of play, one state per frame
+// each frame is stored as the XOR of its state with the previous frame's, zero words
+// run-length coded, so a frame that changed a few bytes costs a few bytes
+// stepping back one frame is one delta applied to the newest state
+class Chip8Rewind
+{
+public:
+    Chip8Rewind(size_t capacity = 4 << 20); // bytes of history, oldest frames are dropped to fit
+
+    void Reset();                  // forget all history
+    void Push(const Chip8 &chip8); // record the state at the end of a frame
+    bool Rewind(Chip8 &chip8);     // go back one frame, false if there is no history left
+
+    size_t Frames(); // frames that can be rewound
+    size_t Used();   // bytes of history in use
+
+private:
+    static const int WORDS = sizeof(Chip8State) / 8;
+
+    std::vector<uint8_t> ring; // records of [length][delta][length], oldest first
+    size_t head;               // where the next record goes
+    size_t used;               // bytes from the oldest record up to head
+    size_t frames;             // records in the ring
+
+    bool started;          // current holds a state
+    Chip8State current; // newest recorded state, the deltas lead back from here
+    Chip8State next;
+    std::vector<uint8_t> delta; // encoding scratch space
+
+    void Encode(const Chip8State &from, const Chip8State &to);
+    void Apply(Chip8State &state);
+    void Write(const void *data, size_t size); // append at head
+    void Read(size_t position, void *data, size_t size);
+    void DropOldest();
+};
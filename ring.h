@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+// fixed size queue between one producer thread and one consumer thread, no locks
+// head only moves on the producer side and tail only on the consumer side, both count
+// up forever and are masked into the buffer, so full and empty never look the same
+template <typename T>
+class SpscRing
+{
+public:
+    SpscRing(size_t capacity) : head(0), tail(0) // rounded up to a power of 2
+    {
+        size = 1;
+        while (size < capacity)
+            size *= 2;
+        buffer.resize(size);
+    }
+
+    size_t Capacity() const { return size; }
+    size_t Size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    // producer side, copies in as many as fit and returns how many that was
+    size_t Push(const T *data, size_t count)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        count = std::min(count, size - (h - tail.load(std::memory_order_acquire)));
+        for (size_t i = 0; i < count; i++)
+            buffer[(h + i) & (size - 1)] = data[i];
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    // consumer side, copies out as many as there are up to count and returns how many
+    size_t Pop(T *data, size_t count)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        count = std::min(count, head.load(std::memory_order_acquire) - t);
+        for (size_t i = 0; i < count; i++)
+            data[i] = buffer[(t + i) & (size - 1)];
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+
+    // in place access, one slot at a time, for elements too big to copy twice
+    // producer side, the free slot to fill, NULL if the ring is full, Commit() hands it over
+    T *Claim()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == size)
+            return NULL;
+        return &buffer[h & (size - 1)];
+    }
+    void Commit() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // consumer side, the oldest slot, NULL if the ring is empty, Release() gives it back
+    const T *Peek()
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t)
+            return NULL;
+        return &buffer[t & (size - 1)];
+    }
+    void Release() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+private:
+    std::vector<T> buffer;
+    size_t size;
+    alignas(64) std::atomic<size_t> head; // next slot the producer writes
+    alignas(64) std::atomic<size_t> tail; // next slot the consumer reads
+};
@@ -0,0 +1,41 @@
+#include "romcache.h"
+
+Chip8RomCache &Chip8RomCache::Shared()
+{
+    static Chip8RomCache cache;
+    return cache;
+}
+
+const Chip8Rom *Chip8RomCache::Load(const char *filename)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = roms.find(filename);
+    if (found != roms.end())
+        return found->second.get();
+
+    FILE *in = fopen(filename, "rb");
+    if (in == NULL)
+        return NULL;
+
+    // read one byte past what fits so an oversized file can be told apart
+    const size_t limit = sizeof(Chip8State::memory) - Chip8State::START_ADDRESS;
+    std::vector<uint8_t> bytes(limit + 1);
+    size_t size = fread(bytes.data(), 1, bytes.size(), in);
+    fclose(in);
+    if (size == 0 || size > limit)
+        return NULL;
+
+    std::unique_ptr<Chip8Rom> rom(new Chip8Rom());
+    rom->path = filename;
+    rom->size = size;
+    rom->hash = Chip8::HashBytes(0xCBF29CE484222325ull, bytes.data(), size);
+
+    // boot a scratch machine once and keep what it looks like
+    std::unique_ptr<Chip8> chip8(new Chip8());
+    chip8->ResetCPU(bytes.data(), size);
+    chip8->SaveState(rom->image);
+
+    const Chip8Rom *loaded = rom.get();
+    roms[filename] = std::move(rom);
+    return loaded;
+}
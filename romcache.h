@@ -0,0 +1,30 @@
+#pragma once
+
+#include "chip8.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// a ROM as read from disk, with the machine it boots into
+struct Chip8Rom
+{
+    std::string path;
+    size_t size;         // bytes of program, 1 to 4096 - 0x200
+    uint64_t hash;       // FNV-1a of the program bytes
+    Chip8State image; // power on state with the program loaded, reset copies this back
+};
+
+// every ROM file is read once, later resets only copy its image
+// safe to use from several threads
+class Chip8RomCache
+{
+public:
+    static Chip8RomCache &Shared(); // the one ResetCPU(filename) uses
+
+    const Chip8Rom *Load(const char *filename); // NULL if missing, empty or too big for memory
+
+private:
+    std::mutex lock;
+    std::map<std::string, std::unique_ptr<Chip8Rom>> roms;
+};
@@ -0,0 +1,339 @@
+#include "chip8.h"
+#include "jit.h"
+#include "aot.h"
+#include "lockstep.h"
+#include "audio.h"
+#include "capture.h"
+#include "trace.h"
+
+using namespace std;
+
+// headless runner, no window and no SDL
+// runs a ROM as fast as possible and reports raw Chip8::Cycle() throughput
+
+int main(int argc, char **argv)
+{
+    // Command usage
+    if (argc < 2)
+    {
+        cout << "Usage: chip8-run <ROM file> [-c cycles | -f frames] [-i instructions per frame] [-j | -A | -l lanes] [-S stats.json | stats.csv] [-a sound.wav | null] [-v video.c8v] [-t trace.c8t [-e every]] [-q default|vip|chip48|schip|xochip]" << endl;
+        return 1;
+    }
+
+    uint64_t cycles = 10000000; // default run length
+    uint64_t frames = 0;
+    uint64_t perFrame = Chip8().instructionsPerFrame; // instructions per 60 Hz frame
+    bool useJit = false;
+    bool useAot = false; // a recompiled module for the ROM, linked into this program
+    int lanes = 0; // lockstep instances, 0 for a single Chip8
+    const char *statsPath = NULL;
+    const char *audioPath = NULL; // beep samples go to a WAV file, or nowhere with "null"
+    const char *videoPath = NULL; // every frame's screen goes to a capture file
+    const char *tracePath = NULL; // every instruction to a binary trace
+    uint32_t traceEvery = 1;      // or every Nth
+    const Chip8Quirks *quirks = &QUIRKS_DEFAULT;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0)
+        {
+            useJit = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-A") == 0)
+        {
+            useAot = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "-c") == 0)
+            cycles = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-f") == 0)
+            frames = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-i") == 0)
+            perFrame = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-l") == 0)
+            lanes = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-S") == 0)
+            statsPath = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0)
+            audioPath = argv[++i];
+        else if (strcmp(argv[i], "-v") == 0)
+            videoPath = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0)
+            tracePath = argv[++i];
+        else if (strcmp(argv[i], "-e") == 0)
+            traceEvery = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            quirks = Chip8::FindQuirks(argv[++i]);
+            if (quirks == NULL)
+            {
+                cout << "Unknown quirk profile " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    if (perFrame == 0)
+    {
+        cout << "Instructions per frame must be at least 1" << endl;
+        return 1;
+    }
+#ifndef CHIP8_STATS
+    if (statsPath != NULL)
+    {
+        cout << "Built without CHIP8_STATS, no counters to write" << endl;
+        return 1;
+    }
+#else
+    Chip8Stats::CatchSignal();
+#endif
+
+    // timers tick after every whole frame, a partial frame at the end just runs
+    if (frames > 0)
+        cycles = frames * perFrame;
+    frames = cycles / perFrame;
+    uint64_t rest = cycles % perFrame;
+
+    if (lanes > 0 && (audioPath != NULL || videoPath != NULL))
+    {
+        cout << "Sound and video need a single machine, leave out -l" << endl;
+        return 1;
+    }
+
+    if ((lanes > 0) + useJit + useAot > 1)
+    {
+        cout << "Pick one of -j, -A and -l" << endl;
+        return 1;
+    }
+
+    if (tracePath != NULL && ((lanes > 0) + useJit + useAot > 0 || traceEvery < 1))
+    {
+        cout << "Tracing needs the interpreter and -e of at least 1" << endl;
+        return 1;
+    }
+
+    if (lanes > 0)
+    {
+        // many copies of the ROM stepped together, count every lane's instructions
+        Chip8Lockstep *group = new Chip8Lockstep(lanes);
+        group->SetQuirks(*quirks);
+        if (!group->ResetCPU(argv[1]))
+        {
+            cout << "Could not load " << argv[1] << endl;
+            return 1;
+        }
+        for (int i = 0; i < group->Count(); i++)
+        {
+            group->Lane(i).instructionsPerFrame = perFrame;
+        }
+
+        auto start = chrono::steady_clock::now();
+        group->RunFrames(frames);
+        group->Run(rest);
+        auto end = chrono::steady_clock::now();
+
+        double seconds = chrono::duration<double>(end - start).count();
+        uint64_t total = group->laneInstructions;
+        printf("lanes:    %d\n", group->Count());
+        printf("cycles:   %llu per lane, %llu total\n", (unsigned long long)cycles, (unsigned long long)total);
+        printf("vector:   %llu steps, %llu lane instructions interpreted\n",
+               (unsigned long long)group->vectorSteps, (unsigned long long)group->scalarSteps);
+        printf("seconds:  %.6f\n", seconds);
+        printf("ips:      %.0f\n", seconds > 0 ? total / seconds : 0.0);
+        printf("ns/instr: %.3f\n", total > 0 ? seconds * 1e9 / total : 0.0);
+
+        delete group;
+        return 0;
+    }
+
+    Chip8 chip8 = Chip8(); // Initialise Chip8
+    chip8.SetQuirks(*quirks);
+    if (!chip8.ResetCPU(argv[1]))
+    {
+        cout << "Could not load " << argv[1] << endl;
+        return 1;
+    }
+    chip8.instructionsPerFrame = perFrame;
+
+    // the sink stands in for a sound card, it takes one frame of samples after every frame
+    Chip8Audio *audio = NULL;
+    Chip8WavWriter wav;
+    vector<int16_t> sink;
+    if (audioPath != NULL)
+    {
+        audio = new Chip8Audio();
+        sink.resize(audio->sampleRate / 60 + 1);
+        if (strcmp(audioPath, "null") != 0 && !wav.Open(audioPath, audio->sampleRate))
+        {
+            cout << "Could not write " << audioPath << endl;
+            return 1;
+        }
+    }
+
+    Chip8Capture *capture = NULL;
+    if (videoPath != NULL)
+    {
+        capture = new Chip8Capture();
+        if (!capture->Open(videoPath))
+        {
+            cout << "Could not write " << videoPath << endl;
+            return 1;
+        }
+    }
+
+    // after every whole frame, same for all backends
+    auto frameDone = [&]()
+    {
+        if (audio != NULL)
+        {
+            audio->Frame(chip8);
+            size_t count = audio->Buffered();
+            audio->Pull(sink.data(), count);
+            wav.Write(sink.data(), count);
+        }
+        if (capture != NULL)
+            capture->Frame(chip8);
+    };
+
+    Chip8Trace *trace = NULL;
+    if (tracePath != NULL)
+    {
+        trace = new Chip8Trace();
+        if (!trace->Open(tracePath, traceEvery))
+        {
+            cout << "Could not write " << tracePath << endl;
+            return 1;
+        }
+        trace->Attach(chip8);
+    }
+
+    Chip8Jit *jit = NULL;
+    if (useJit)
+    {
+        jit = new Chip8Jit();
+        if (!jit->Available())
+            cout << "JIT not available, interpreting" << endl;
+        jit->Attach(chip8);
+    }
+
+    Chip8Aot *aot = NULL;
+    if (useAot)
+    {
+        const Chip8AotModule *module = Chip8Aot::Find(chip8);
+        if (module == NULL)
+            cout << "No recompiled module for " << argv[1] << " with " << chip8.quirks->name << " quirks, interpreting" << endl;
+        else
+        {
+            aot = new Chip8Aot(*module);
+            aot->Attach(chip8);
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    if (jit != NULL)
+    {
+        for (uint64_t f = 0; f < frames; f++)
+        {
+            jit->RunFrame(chip8);
+            frameDone();
+        }
+        jit->Run(chip8, rest);
+    }
+    else if (aot != NULL)
+    {
+        for (uint64_t f = 0; f < frames; f++)
+        {
+            aot->RunFrame(chip8);
+            frameDone();
+        }
+        aot->Run(chip8, rest);
+    }
+    else
+    {
+        for (uint64_t f = 0; f < frames; f++)
+        {
+            chip8.RunFrame();
+            frameDone();
+#ifdef CHIP8_STATS
+            // kill -USR1 writes the counters so far
+            if (statsPath != NULL && Chip8Stats::Requested())
+                chip8.stats.Write(statsPath);
+#endif
+        }
+        chip8.Run(rest);
+    }
+    auto end = chrono::steady_clock::now();
+
+    double seconds = chrono::duration<double>(end - start).count();
+    printf("cycles:   %llu\n", (unsigned long long)cycles);
+    printf("seconds:  %.6f\n", seconds);
+    printf("ips:      %.0f\n", seconds > 0 ? cycles / seconds : 0.0);
+    printf("ns/instr: %.3f\n", cycles > 0 ? seconds * 1e9 / cycles : 0.0);
+    if (chip8.fault == Chip8State::FAULT_EXIT)
+        printf("exit:     00FD at %03X\n", chip8.programCounter);
+    else if (chip8.fault != Chip8State::FAULT_NONE)
+        printf("fault:    stack %s at %03X\n", chip8.fault == Chip8State::FAULT_STACK_OVERFLOW ? "overflow" : "underflow",
+               chip8.programCounter);
+    if (aot != NULL)
+        printf("aot:      %llu instructions compiled, %llu interpreted\n", (unsigned long long)aot->nativeSteps,
+               (unsigned long long)aot->interpretedSteps);
+    if (trace != NULL)
+    {
+        bool written = trace->Close();
+        printf("trace:    %llu records, %llu bytes\n", (unsigned long long)trace->Records(),
+               (unsigned long long)trace->Bytes());
+        if (!written)
+        {
+            cout << "Could not write " << tracePath << endl;
+            return 1;
+        }
+    }
+    if (capture != NULL)
+    {
+        // waits for the encoder to catch up, the time above doesn't include it
+        bool written = capture->Close();
+        printf("video:    %llu frames, %llu bytes, %llu stalls\n", (unsigned long long)capture->Frames(),
+               (unsigned long long)capture->Bytes(), (unsigned long long)capture->Stalls());
+        if (!written)
+        {
+            cout << "Could not write " << videoPath << endl;
+            return 1;
+        }
+    }
+    if (audio != NULL)
+    {
+        printf("audio:    %llu samples, %llu underruns, %llu overruns\n", (unsigned long long)audio->Generated(),
+               (unsigned long long)audio->Underruns(), (unsigned long long)audio->Overruns());
+        if (!wav.Close())
+        {
+            cout << "Could not write " << audioPath << endl;
+            return 1;
+        }
+    }
+
+#ifdef CHIP8_STATS
+    if (statsPath != NULL && !chip8.stats.Write(statsPath))
+    {
+        cout << "Could not write " << statsPath << endl;
+        return 1;
+    }
+#endif
+
+    delete jit;
+    delete aot;
+    delete audio;
+    delete capture;
+    delete trace;
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "chip8.h"
+#include "stream.h"
+#include <signal.h>
+
+using namespace std;
+
+// runs ROMs headless at 60 frames a second and streams their screens to viewers
+// (stream.cxx), chip8-watch is a viewer, Ctrl+C stops it
+
+static volatile sig_atomic_t stopping = 0;
+
+static void Stop(int)
+{
+    stopping = 1;
+}
+
+int main(int argc, char **argv)
+{
+    // Command usage
+    if (argc < 2)
+    {
+        cout << "Usage: chip8-serve <ROM file> [more ROM files...] [-s socket path] [-p TCP port] [-n copies of each ROM] [-i instructions per frame] [-r frames per second, 0 for flat out] [-f frames] [-q default|vip|chip48|schip|xochip]" << endl;
+        return 1;
+    }
+
+    vector<char *> roms;
+    const char *socketPath = "chip8.sock";
+    int port = 0;
+    int copies = 1;
+    int perFrame = Chip8().instructionsPerFrame;
+    int rate = 60;
+    uint64_t frames = 0; // 0 runs until stopped
+    const Chip8Quirks *quirks = &QUIRKS_DEFAULT;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+        {
+            roms.push_back(argv[i]);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "-s") == 0)
+            socketPath = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0)
+            port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0)
+            copies = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-i") == 0)
+            perFrame = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0)
+            rate = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0)
+            frames = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            quirks = Chip8::FindQuirks(argv[++i]);
+            if (quirks == NULL)
+            {
+                cout << "Unknown quirk profile " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    if (roms.empty() || copies < 1 || copies * roms.size() > 256 || perFrame < 1 || rate < 0)
+    {
+        cout << "Need 1 to 256 machines, at least 1 instruction per frame and a rate of 0 or more" << endl;
+        return 1;
+    }
+
+    // machine k is copy k % copies of ROM k / copies, copies get their own random seeds
+    vector<Chip8 *> machines;
+    Chip8StreamServer *server = new Chip8StreamServer();
+    for (size_t r = 0; r < roms.size(); r++)
+    {
+        for (int c = 0; c < copies; c++)
+        {
+            Chip8 *chip8 = new Chip8();
+            chip8->seed = c;
+            chip8->SetQuirks(*quirks);
+            if (!chip8->ResetCPU(roms[r]))
+            {
+                cout << "Could not load " << roms[r] << endl;
+                return 1;
+            }
+            chip8->instructionsPerFrame = perFrame;
+            machines.push_back(chip8);
+            server->Add(*chip8);
+        }
+    }
+
+    if (!server->Listen(socketPath))
+    {
+        cout << "Could not listen on " << socketPath << endl;
+        return 1;
+    }
+    if (port != 0 && !server->ListenTcp(port))
+    {
+        cout << "Could not listen on 127.0.0.1:" << port << endl;
+        return 1;
+    }
+    printf("serving:  %zu machines on %s", machines.size(), socketPath);
+    if (port != 0)
+        printf(" and 127.0.0.1:%d", port);
+    printf("\n");
+    fflush(stdout);
+
+    signal(SIGINT, Stop);
+    signal(SIGTERM, Stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    // run a frame when it is due, serve viewers in between
+    auto start = chrono::steady_clock::now();
+    uint64_t frame = 0;
+    while (!stopping && (frames == 0 || frame < frames))
+    {
+        for (size_t i = 0; i < machines.size(); i++)
+        {
+            machines[i]->RunFrame();
+            server->Publish(i);
+        }
+        frame++;
+
+        auto due = start + chrono::microseconds(rate > 0 ? frame * 1000000 / rate : 0);
+        do
+        {
+            auto left = chrono::duration_cast<chrono::microseconds>(due - chrono::steady_clock::now()).count();
+            server->Poll(left > 0 ? (left + 999) / 1000 : 0);
+        } while (!stopping && chrono::steady_clock::now() < due);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("frames:   %llu in %.3f s\n", (unsigned long long)frame, seconds);
+    printf("viewers:  %zu connected, %llu updates sent, %llu resyncs\n", server->Viewers(),
+           (unsigned long long)server->Updates(), (unsigned long long)server->Resyncs());
+
+    delete server; // lets go of keys viewers still hold, the machines have to outlive it
+    for (size_t i = 0; i < machines.size(); i++)
+        delete machines[i];
+    return 0;
+}
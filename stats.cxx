@@ -0,0 +1,154 @@
+#ifdef CHIP8_STATS
+
+#include "chip8.h"
+#include <signal.h>
+#include <map>
+#include <algorithm>
+
+Chip8Stats::Chip8Stats()
+    : opcodes(65536), pcs(4096)
+{
+    Clear();
+}
+
+void Chip8Stats::Clear()
+{
+    instructions = 0;
+    idleSkipped = 0;
+    skips = 0;
+    draws = 0;
+    pixels = 0;
+    collisions = 0;
+    stackHighWater = 0;
+    std::fill(opcodes.begin(), opcodes.end(), 0);
+    std::fill(pcs.begin(), pcs.end(), 0);
+}
+
+void Chip8Stats::Add(const Chip8Stats &other)
+{
+    instructions += other.instructions;
+    idleSkipped += other.idleSkipped;
+    skips += other.skips;
+    draws += other.draws;
+    pixels += other.pixels;
+    collisions += other.collisions;
+    stackHighWater = std::max(stackHighWater, other.stackHighWater);
+    for (size_t i = 0; i < opcodes.size(); i++)
+        opcodes[i] += other.opcodes[i];
+    for (size_t i = 0; i < pcs.size(); i++)
+        pcs[i] += other.pcs[i];
+}
+
+// busiest first
+static std::vector<std::pair<const char *, uint64_t>> Families(const std::vector<uint64_t> &opcodes)
+{
+    std::map<const char *, uint64_t> sums;
+    for (size_t i = 0; i < opcodes.size(); i++)
+    {
+        if (opcodes[i] != 0)
+            sums[Chip8::OpcodeName(i)] += opcodes[i];
+    }
+    std::vector<std::pair<const char *, uint64_t>> families(sums.begin(), sums.end());
+    std::stable_sort(families.begin(), families.end(), [](const std::pair<const char *, uint64_t> &a, const std::pair<const char *, uint64_t> &b)
+                     { return a.second > b.second; });
+    return families;
+}
+
+bool Chip8Stats::Write(const char *filename)
+{
+    FILE *out = fopen(filename, "w");
+    if (out == NULL)
+        return false;
+
+    std::vector<std::pair<const char *, uint64_t>> families = Families(opcodes);
+    size_t length = strlen(filename);
+    bool csv = length >= 4 && strcmp(filename + length - 4, ".csv") == 0;
+
+    if (csv)
+    {
+        // one counter per line, kind says which table it belongs to
+        fprintf(out, "kind,key,count\n");
+        fprintf(out, "total,instructions,%llu\n", (unsigned long long)instructions);
+        fprintf(out, "total,idle_skipped,%llu\n", (unsigned long long)idleSkipped);
+        fprintf(out, "total,skips,%llu\n", (unsigned long long)skips);
+        fprintf(out, "total,draws,%llu\n", (unsigned long long)draws);
+        fprintf(out, "total,pixels,%llu\n", (unsigned long long)pixels);
+        fprintf(out, "total,collisions,%llu\n", (unsigned long long)collisions);
+        fprintf(out, "total,stack_high_water,%llu\n", (unsigned long long)stackHighWater);
+        for (size_t i = 0; i < families.size(); i++)
+            fprintf(out, "family,%s,%llu\n", families[i].first, (unsigned long long)families[i].second);
+        for (size_t i = 0; i < opcodes.size(); i++)
+        {
+            if (opcodes[i] != 0)
+                fprintf(out, "opcode,%04zX,%llu\n", i, (unsigned long long)opcodes[i]);
+        }
+        for (size_t i = 0; i < pcs.size(); i++)
+        {
+            if (pcs[i] != 0)
+                fprintf(out, "pc,%03zX,%llu\n", i, (unsigned long long)pcs[i]);
+        }
+    }
+    else
+    {
+        fprintf(out, "{\n");
+        fprintf(out, "  \"instructions\": %llu,\n", (unsigned long long)instructions);
+        fprintf(out, "  \"idle_skipped\": %llu,\n", (unsigned long long)idleSkipped);
+        fprintf(out, "  \"skips\": %llu,\n", (unsigned long long)skips);
+        fprintf(out, "  \"draws\": %llu,\n", (unsigned long long)draws);
+        fprintf(out, "  \"pixels\": %llu,\n", (unsigned long long)pixels);
+        fprintf(out, "  \"collisions\": %llu,\n", (unsigned long long)collisions);
+        fprintf(out, "  \"stack_high_water\": %llu,\n", (unsigned long long)stackHighWater);
+
+        fprintf(out, "  \"families\": {");
+        for (size_t i = 0; i < families.size(); i++)
+            fprintf(out, "%s\n    \"%s\": %llu", i ? "," : "", families[i].first, (unsigned long long)families[i].second);
+        fprintf(out, "\n  },\n");
+
+        const char *separator = "";
+        fprintf(out, "  \"opcodes\": {");
+        for (size_t i = 0; i < opcodes.size(); i++)
+        {
+            if (opcodes[i] == 0)
+                continue;
+            fprintf(out, "%s\n    \"%04zX\": %llu", separator, i, (unsigned long long)opcodes[i]);
+            separator = ",";
+        }
+        fprintf(out, "\n  },\n");
+
+        separator = "";
+        fprintf(out, "  \"pcs\": {");
+        for (size_t i = 0; i < pcs.size(); i++)
+        {
+            if (pcs[i] == 0)
+                continue;
+            fprintf(out, "%s\n    \"%03zX\": %llu", separator, i, (unsigned long long)pcs[i]);
+            separator = ",";
+        }
+        fprintf(out, "\n  }\n}\n");
+    }
+    return fclose(out) == 0;
+}
+
+static volatile sig_atomic_t requested;
+
+static void OnSignal(int)
+{
+    requested = 1; // only set a flag, the file is written outside the handler
+}
+
+void Chip8Stats::CatchSignal()
+{
+#ifdef SIGUSR1
+    signal(SIGUSR1, OnSignal);
+#endif
+}
+
+bool Chip8Stats::Requested()
+{
+    if (!requested)
+        return false;
+    requested = 0;
+    return true;
+}
+
+#endif
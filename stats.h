@@ -0,0 +1,38 @@
+#pragma once
+
+// execution counters for one Chip8, only built with -DCHIP8_STATS
+// release builds have no counters and the hooks compile to nothing
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+struct Chip8Stats
+{
+    uint64_t instructions; // executed one at a time
+    uint64_t idleSkipped;  // instructions skipped by idle loop detection
+    uint64_t skips;        // 3XNN, 4XNN, 5XY0, 9XY0, EX9E, EXA1 that skipped
+    uint64_t draws;        // DXYN calls
+    uint64_t pixels;       // pixels flipped by DXYN
+    uint64_t collisions;   // DXYN calls that set VF
+    uint64_t stackHighWater;
+
+    std::vector<uint64_t> opcodes; // executions per raw opcode, families are summed when written
+    std::vector<uint64_t> pcs;     // executions per address
+
+    Chip8Stats();
+    void Clear();
+    void Add(const Chip8Stats &other); // sum in another machine's counters
+
+    void Count(uint16_t pc, uint16_t opcode)
+    {
+        instructions++;
+        opcodes[opcode]++;
+        pcs[pc & 0xFFF]++;
+    }
+
+    bool Write(const char *filename); // CSV if the name ends in .csv, JSON otherwise
+
+    // SIGUSR1 asks for a dump, frontends check between frames
+    static void CatchSignal();
+    static bool Requested(); // true once per signal
+};
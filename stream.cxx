@@ -0,0 +1,368 @@
+#include "stream.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+using namespace std;
+
+static const uint8_t MAGIC[4] = {'C', '8', 'V', 1};
+
+static Chip8CaptureFrame Screen(const Chip8 &chip8)
+{
+    Chip8CaptureFrame frame;
+    memcpy(frame.video, chip8.video, sizeof(frame.video));
+    frame.hires = chip8.hires;
+    return frame;
+}
+
+Chip8StreamServer::Chip8StreamServer() : viewerCount(0), updates(0), resyncs(0)
+{
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+Chip8StreamServer::~Chip8StreamServer()
+{
+    for (size_t fd = 0; fd < viewers.size(); fd++)
+    {
+        if (viewers[fd] != NULL)
+            Kill(*viewers[fd]);
+    }
+    Reap();
+    for (size_t i = 0; i < listeners.size(); i++)
+        close(listeners[i]);
+    if (!socketPath.empty())
+        unlink(socketPath.c_str());
+    if (epoll >= 0)
+        close(epoll);
+    if (spare >= 0)
+        close(spare);
+}
+
+void Chip8StreamServer::Watch(int fd, uint32_t events, int op)
+{
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(epoll, op, fd, &event);
+}
+
+bool Chip8StreamServer::Listen(const char *path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (epoll < 0 || strlen(path) >= sizeof(address.sun_path))
+        return false;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    unlink(path); // left behind by a server that didn't get to clean up
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    socketPath = path;
+    listeners.push_back(fd);
+    Watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+    return true;
+}
+
+bool Chip8StreamServer::ListenTcp(int port)
+{
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (epoll < 0)
+        return false;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    listeners.push_back(fd);
+    Watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+    return true;
+}
+
+int Chip8StreamServer::Add(Chip8 &chip8)
+{
+    Machine machine;
+    machine.chip8 = &chip8;
+    machine.screen = Screen(chip8);
+    memset(machine.holds, 0, sizeof(machine.holds));
+    machines.push_back(machine);
+    return machines.size() - 1;
+}
+
+size_t Chip8StreamServer::Viewers() const
+{
+    return viewerCount;
+}
+
+uint64_t Chip8StreamServer::Updates() const
+{
+    return updates;
+}
+
+uint64_t Chip8StreamServer::Resyncs() const
+{
+    return resyncs;
+}
+
+void Chip8StreamServer::Publish(int index)
+{
+    // only frames that drew anything are compared, a sprite drawn and erased again can leave it unchanged
+    Machine &machine = machines[index];
+    Chip8 &chip8 = *machine.chip8;
+    if (!chip8.videoDirty)
+        return;
+    chip8.ClearDirty();
+    if (memcmp(machine.screen.video, chip8.video, sizeof(chip8.video)) == 0 && machine.screen.hires == chip8.hires)
+        return;
+
+    // encoded once, every viewer gets the same bytes
+    Chip8CaptureFrame now = Screen(chip8);
+    if (!machine.viewers.empty())
+    {
+        vector<uint8_t> *record = new vector<uint8_t>();
+        Chip8Capture::Record(&machine.screen, now, *record);
+        Bytes shared(record);
+        for (size_t i = 0; i < machine.viewers.size(); i++)
+            Queue(*machine.viewers[i], shared);
+    }
+    machine.screen = now;
+    Reap();
+}
+
+void Chip8StreamServer::Poll(int timeoutMs)
+{
+    epoll_event events[64];
+    int count = epoll_wait(epoll, events, 64, timeoutMs);
+    for (int i = 0; i < count; i++)
+    {
+        int fd = events[i].data.fd;
+        if (find(listeners.begin(), listeners.end(), fd) != listeners.end())
+        {
+            Accept(fd);
+            continue;
+        }
+
+        Viewer *viewer = (size_t)fd < viewers.size() ? viewers[fd] : NULL;
+        if (viewer == NULL || viewer->dead)
+            continue;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            Read(*viewer);
+        if ((events[i].events & EPOLLOUT) && !viewer->dead)
+            Flush(*viewer);
+    }
+    Reap();
+}
+
+void Chip8StreamServer::Accept(int listener)
+{
+    for (;;)
+    {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (fd < 0 && (errno == EMFILE || errno == ENFILE) && spare >= 0)
+        {
+            // out of descriptors, the connection would sit in the backlog and keep the listener
+            // readable forever, so give up the spare one to take it off and turn it away
+            close(spare);
+            fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0)
+                close(fd);
+            spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (fd >= 0)
+                continue;
+        }
+        if (fd < 0)
+            return; // EAGAIN once the backlog is empty
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // fails harmlessly on Unix sockets
+
+        if ((size_t)fd >= viewers.size())
+            viewers.resize(fd + 1, NULL);
+        viewers[fd] = new Viewer();
+        viewers[fd]->fd = fd;
+        viewerCount++;
+        Watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+    }
+}
+
+void Chip8StreamServer::Read(Viewer &viewer)
+{
+    uint8_t buffer[512];
+    for (;;)
+    {
+        ssize_t got = recv(viewer.fd, buffer, sizeof(buffer), 0);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            Kill(viewer); // gone
+            return;
+        }
+
+        size_t i = 0;
+        if (viewer.split)
+        {
+            Message(viewer, viewer.partial, buffer[0]);
+            viewer.split = false;
+            i = 1;
+        }
+        for (; i + 1 < (size_t)got && !viewer.dead; i += 2)
+            Message(viewer, buffer[i], buffer[i + 1]);
+        if (i < (size_t)got)
+        {
+            viewer.partial = buffer[i];
+            viewer.split = true;
+        }
+        if (viewer.dead)
+            return;
+    }
+}
+
+void Chip8StreamServer::Message(Viewer &viewer, uint8_t type, uint8_t value)
+{
+    if (type == 'S' && viewer.machine < 0 && value < machines.size())
+    {
+        Machine &machine = machines[value];
+        viewer.machine = value;
+        machine.viewers.push_back(&viewer);
+
+        vector<uint8_t> *start = new vector<uint8_t>(MAGIC, MAGIC + sizeof(MAGIC));
+        Chip8Capture::Record(NULL, machine.screen, *start);
+        Queue(viewer, Bytes(start));
+        return;
+    }
+    if ((type == 'D' || type == 'U') && viewer.machine >= 0 && value < 16)
+    {
+        Press(viewer, value, type == 'D');
+        return;
+    }
+    Kill(viewer);
+}
+
+void Chip8StreamServer::Press(Viewer &viewer, int key, bool down)
+{
+    // repeats and letting go of a key it never pressed change nothing
+    if (((viewer.held >> key) & 1) == down)
+        return;
+    Machine &machine = machines[viewer.machine];
+    if (down)
+    {
+        viewer.held |= 1 << key;
+        machine.holds[key]++;
+        machine.chip8->inputKeys[key] = 1;
+    }
+    else
+    {
+        viewer.held &= ~(1 << key);
+        if (--machine.holds[key] == 0)
+            machine.chip8->inputKeys[key] = 0;
+    }
+}
+
+void Chip8StreamServer::Queue(Viewer &viewer, const Bytes &record)
+{
+    if (viewer.queue.size() >= MAX_QUEUED)
+    {
+        // too far behind to catch up, keep only a half sent record (or the greeting if it
+        // hasn't gone out yet) and start over from the current screen
+        size_t keep = viewer.offset > 0 || viewer.sent == 0 ? 1 : 0;
+        while (viewer.queue.size() > keep)
+            viewer.queue.pop_back();
+        vector<uint8_t> *start = new vector<uint8_t>();
+        Chip8Capture::Record(NULL, Screen(*machines[viewer.machine].chip8), *start);
+        viewer.queue.push_back(Bytes(start));
+        resyncs++;
+    }
+    else
+    {
+        viewer.queue.push_back(record);
+    }
+    if (!viewer.writing)
+        Flush(viewer); // otherwise EPOLLOUT will
+}
+
+void Chip8StreamServer::Flush(Viewer &viewer)
+{
+    while (!viewer.queue.empty())
+    {
+        const vector<uint8_t> &front = *viewer.queue.front();
+        ssize_t sent = send(viewer.fd, front.data() + viewer.offset, front.size() - viewer.offset, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!viewer.writing)
+                Watch(viewer.fd, EPOLLIN | EPOLLRDHUP | EPOLLOUT, EPOLL_CTL_MOD);
+            viewer.writing = true;
+            return;
+        }
+        if (sent < 0)
+        {
+            Kill(viewer);
+            return;
+        }
+        viewer.offset += sent;
+        if (viewer.offset == front.size())
+        {
+            viewer.queue.pop_front();
+            viewer.offset = 0;
+            viewer.sent++;
+            updates++;
+        }
+    }
+    if (viewer.writing)
+        Watch(viewer.fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+    viewer.writing = false;
+}
+
+void Chip8StreamServer::Kill(Viewer &viewer)
+{
+    if (!viewer.dead)
+        dying.push_back(&viewer);
+    viewer.dead = true;
+}
+
+void Chip8StreamServer::Reap()
+{
+    for (size_t i = 0; i < dying.size(); i++)
+    {
+        Viewer *viewer = dying[i];
+        if (viewer->machine >= 0)
+        {
+            Machine &machine = machines[viewer->machine];
+            for (int key = 0; key < 16; key++)
+                Press(*viewer, key, false);
+            machine.viewers.erase(find(machine.viewers.begin(), machine.viewers.end(), viewer));
+        }
+        epoll_ctl(epoll, EPOLL_CTL_DEL, viewer->fd, NULL);
+        close(viewer->fd);
+        viewers[viewer->fd] = NULL;
+        delete viewer;
+        viewerCount--;
+    }
+    dying.clear();
+}
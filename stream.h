@@ -0,0 +1,87 @@
+#pragma once
+
+#include "chip8.h"
+#include "capture.h"
+#include <memory>
+#include <deque>
+
+// mirrors running machines to any number of viewers over a Unix domain socket, and over
+// loopback TCP if asked, Linux only (epoll)
+// everything happens on the thread that owns the machines, Publish after a frame and Poll
+// while waiting for the next, sockets are non-blocking so one thread keeps hundreds of
+// viewers fed and a slow viewer never holds up the machines or the other viewers
+//
+// protocol, viewer to server, 2 bytes a message:
+//   'S' machine  watch that machine, once, before anything else
+//   'D' key      key 0-F down
+//   'U' key      key 0-F up
+// server to viewer after 'S': "C8V" 1 then capture records (capture.h) whenever the screen
+// changes, the first one a fresh start with the whole screen, so the stream is a .c8v file
+// a viewer that gets MAX_QUEUED records behind loses its backlog and gets a fresh start
+// instead, a key is down while any viewer holds it and keys a viewer holds are let go when
+// it leaves, anything else it sends closes it
+class Chip8StreamServer
+{
+public:
+    static const size_t MAX_QUEUED = 64;
+
+    Chip8StreamServer();
+    ~Chip8StreamServer();
+
+    bool Listen(const char *path); // Unix domain socket, a socket file already at path is replaced
+    bool ListenTcp(int port);      // 127.0.0.1 only
+    int Add(Chip8 &chip8);         // serve a machine, returns the number viewers ask for with 'S', its videoDirty is the server's from now on
+
+    void Publish(int machine); // after a frame, queues the screen for its viewers if it changed, clears videoDirty
+    void Poll(int timeoutMs);  // new viewers, key events and queued updates, waits up to timeoutMs for any
+
+    size_t Viewers() const;
+    uint64_t Updates() const; // records handed to viewers, counted per viewer
+    uint64_t Resyncs() const; // backlogs dropped for a fresh start
+
+private:
+    typedef std::shared_ptr<const std::vector<uint8_t>> Bytes; // one encoding shared by every viewer of a machine
+
+    struct Viewer
+    {
+        int fd;
+        int machine = -1;  // -1 until 'S'
+        uint16_t held = 0; // keys it has down
+        uint8_t partial;   // first byte of a message cut in two
+        bool split = false;
+        bool writing = false; // waiting for EPOLLOUT
+        bool dead = false;    // closed at the end of the current Poll or Publish
+        std::deque<Bytes> queue;
+        size_t offset = 0; // bytes of queue.front() already sent
+        uint64_t sent = 0; // records sent, the first is the greeting
+    };
+
+    struct Machine
+    {
+        Chip8 *chip8;
+        Chip8CaptureFrame screen; // what viewers have been sent
+        std::vector<Viewer *> viewers;
+        int holds[16]; // viewers holding each key down, it is let go when the last one does
+    };
+
+    int epoll;
+    int spare; // kept open to have one to close when accept runs out of descriptors
+    std::vector<int> listeners;
+    std::string socketPath; // removed again on destruction
+    std::vector<Viewer *> viewers; // by fd, NULL where there is none
+    std::vector<Machine> machines;
+    std::vector<Viewer *> dying; // killed since the last Reap
+    size_t viewerCount;
+    uint64_t updates;
+    uint64_t resyncs;
+
+    void Watch(int fd, uint32_t events, int op);
+    void Accept(int listener);
+    void Read(Viewer &viewer);
+    void Message(Viewer &viewer, uint8_t type, uint8_t value);
+    void Press(Viewer &viewer, int key, bool down);
+    void Queue(Viewer &viewer, const Bytes &record);
+    void Flush(Viewer &viewer);
+    void Kill(Viewer &viewer); // closed at the next Reap, nothing is sent to it from now on
+    void Reap();
+};
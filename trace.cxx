@@ -0,0 +1,313 @@
+#include "trace.h"
+
+using namespace std;
+
+static const char MAGIC[8] = {'C', '8', 'T', 'R', 'A', 'C', 'E', 1};
+
+static void Put(vector<uint8_t> &out, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++)
+        out.push_back(value >> (8 * i));
+}
+
+static void Set(uint8_t *at, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++)
+        at[i] = value >> (8 * i);
+}
+
+static uint16_t Get16(const uint8_t *in)
+{
+    return in[0] | (in[1] << 8);
+}
+
+Chip8Trace::Chip8Trace() : file(NULL), ok(true), every(1), countdown(0), instructions(0), records(0), bytes(0),
+                           active(false), started(false), writeCount(0), used(0), blockRecords(0), blockFirst(0)
+{
+}
+
+Chip8Trace::~Chip8Trace()
+{
+    Close();
+}
+
+bool Chip8Trace::Open(const char *path, uint32_t every)
+{
+    Close();
+    file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    setvbuf(file, NULL, _IONBF, 0); // whole blocks go out in one write anyway
+
+    this->every = every < 1 ? 1 : every;
+    countdown = 0;
+    instructions = 0;
+    records = 0;
+    active = false;
+    started = false;
+
+    vector<uint8_t> header(MAGIC, MAGIC + sizeof(MAGIC));
+    Put(header, this->every, 4);
+    Put(header, BLOCK_RECORDS, 4);
+    ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+    bytes = header.size();
+
+    block.resize(BLOCK_HEADER_SIZE + BLOCK_RECORDS * 16); // typical records are 8 to 12 bytes, grows if not
+    used = BLOCK_HEADER_SIZE;
+    blockRecords = 0;
+    return ok;
+}
+
+void Chip8Trace::Attach(Chip8 &chip8)
+{
+    chip8.trace = this;
+}
+
+bool Chip8Trace::Close()
+{
+    if (file == NULL)
+        return ok;
+    Flush();
+    ok &= fclose(file) == 0;
+    file = NULL;
+    return ok;
+}
+
+uint64_t Chip8Trace::Records() const
+{
+    return records;
+}
+
+uint64_t Chip8Trace::Bytes() const
+{
+    return bytes;
+}
+
+bool Chip8Trace::Sample()
+{
+    instructions++;
+    if (file == NULL)
+        return false;
+    if (countdown > 0)
+    {
+        countdown--;
+        return false;
+    }
+    countdown = every - 1;
+    return true;
+}
+
+uint32_t Chip8Trace::Gap() const
+{
+    return file == NULL ? UINT32_MAX : countdown;
+}
+
+void Chip8Trace::Skip(uint32_t count)
+{
+    instructions += count;
+    if (file != NULL)
+        countdown -= count;
+}
+
+void Chip8Trace::Before(const Chip8 &chip8)
+{
+    active = true;
+    pc = chip8.programCounter;
+    writeCount = 0;
+}
+
+void Chip8Trace::Wrote(uint16_t address, int length)
+{
+    // one write per instruction is all any opcode does, anything past MAX_WRITES is dropped
+    if (!active || writeCount == MAX_WRITES)
+        return;
+    writes[writeCount].address = address & 0xFFF;
+    writes[writeCount].length = length;
+    writeCount++;
+}
+
+void Chip8Trace::After(const Chip8 &chip8)
+{
+    active = false;
+    if (blockRecords == 0)
+        blockFirst = instructions - 1;
+
+    // room for the longest record this can be, trimmed to what was written at the end
+    size_t room = 7 + 2 + 16 + 1 + 2;
+    for (int w = 0; w < writeCount; w++)
+        room += writes[w].length + 3 * (writes[w].length / 255 + 1);
+    if (used + room > block.size())
+        block.resize(2 * (used + room));
+    uint8_t *out = &block[used];
+
+    uint8_t *flags = out++;
+    *flags = 0;
+    Set(out, pc, 2);
+    Set(out + 2, chip8.opcode, 2);
+    Set(out + 4, chip8.indexRegister, 2);
+    out += 6;
+
+    // a byte mask of the registers that differ, 8 at a time
+    uint16_t changed = started ? 0 : 0xFFFF;
+    for (int half = 0; half < 2 && started; half++)
+    {
+        uint64_t now, then;
+        memcpy(&now, chip8.registers + 8 * half, 8);
+        memcpy(&then, lastRegisters + 8 * half, 8);
+        for (uint64_t diff = now ^ then; diff != 0; diff &= diff - 1)
+            changed |= 1 << (8 * half + __builtin_ctzll(diff) / 8);
+    }
+    if (changed != 0)
+    {
+        *flags |= Chip8TraceRecord::REGISTERS;
+        Set(out, changed, 2);
+        out += 2;
+        for (int i = 0; i < 16; i++)
+        {
+            if (changed & (1 << i))
+                *out++ = chip8.registers[i];
+        }
+        memcpy(lastRegisters, chip8.registers, 16);
+    }
+
+    if (writeCount > 0)
+    {
+        // runs longer than a length byte are split, the bytes as they are now
+        *flags |= Chip8TraceRecord::WRITES;
+        uint8_t *runs = out++;
+        *runs = 0;
+        for (int w = 0; w < writeCount; w++)
+        {
+            for (int done = 0; done < writes[w].length && *runs < 255; done += 255)
+            {
+                int length = min(writes[w].length - done, 255);
+                uint16_t address = (writes[w].address + done) & 0xFFF;
+                Set(out, address, 2);
+                out[2] = length;
+                out += 3;
+                for (int i = 0; i < length; i++)
+                    *out++ = chip8.memory[(address + i) & 0xFFF];
+                (*runs)++;
+            }
+        }
+    }
+
+    if (!started || chip8.delayTimer != lastDelay || chip8.soundTimer != lastSound)
+    {
+        *flags |= Chip8TraceRecord::TIMERS;
+        out[0] = chip8.delayTimer;
+        out[1] = chip8.soundTimer;
+        out += 2;
+        lastDelay = chip8.delayTimer;
+        lastSound = chip8.soundTimer;
+    }
+
+    used = out - block.data();
+    started = true;
+    records++;
+    if (++blockRecords == BLOCK_RECORDS)
+        Flush();
+}
+
+void Chip8Trace::Flush()
+{
+    if (blockRecords == 0)
+        return;
+    Set(&block[0], used - BLOCK_HEADER_SIZE, 4);
+    Set(&block[4], blockRecords, 4);
+    Set(&block[8], blockFirst, 8);
+    ok &= fwrite(block.data(), 1, used, file) == used;
+    bytes += used;
+    used = BLOCK_HEADER_SIZE;
+    blockRecords = 0;
+}
+
+size_t Chip8TraceRecord::Read(const uint8_t *in, size_t available)
+{
+    const uint8_t *at = in;
+    const uint8_t *end = in + available;
+    if (end - at < 7)
+        return 0;
+    flags = at[0];
+    pc = Get16(at + 1);
+    opcode = Get16(at + 3);
+    indexRegister = Get16(at + 5);
+    at += 7;
+
+    changed = 0;
+    if (flags & REGISTERS)
+    {
+        if (end - at < 2)
+            return 0;
+        changed = Get16(at);
+        at += 2;
+        for (int i = 0; i < 16; i++)
+        {
+            if (!(changed & (1 << i)))
+                continue;
+            if (at == end)
+                return 0;
+            registers[i] = *at++;
+        }
+    }
+
+    writes.clear();
+    if (flags & WRITES)
+    {
+        if (at == end)
+            return 0;
+        int runs = *at++;
+        for (int r = 0; r < runs; r++)
+        {
+            if (end - at < 3)
+                return 0;
+            Write w = {Get16(at), at[2], at + 3};
+            at += 3;
+            if (end - at < w.length)
+                return 0;
+            at += w.length;
+            writes.push_back(w);
+        }
+    }
+
+    if (flags & TIMERS)
+    {
+        if (end - at < 2)
+            return 0;
+        delayTimer = at[0];
+        soundTimer = at[1];
+        at += 2;
+    }
+    return at - in;
+}
+
+string Chip8TraceRecord::Describe() const
+{
+    char text[64];
+    snprintf(text, sizeof(text), "%03X %04X %-5s I=%03X", pc, opcode, Chip8::OpcodeName(opcode), indexRegister);
+    string line = text;
+    for (int i = 0; i < 16; i++)
+    {
+        if (changed & (1 << i))
+        {
+            snprintf(text, sizeof(text), " V%X=%02X", i, registers[i]);
+            line += text;
+        }
+    }
+    for (size_t w = 0; w < writes.size(); w++)
+    {
+        snprintf(text, sizeof(text), " [%03X]=", writes[w].address);
+        line += text;
+        for (int i = 0; i < writes[w].length; i++)
+        {
+            snprintf(text, sizeof(text), "%02X", writes[w].bytes[i]);
+            line += text;
+        }
+    }
+    if (flags & TIMERS)
+    {
+        snprintf(text, sizeof(text), " DT=%02X ST=%02X", delayTimer, soundTimer);
+        line += text;
+    }
+    return line;
+}
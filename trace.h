@@ -0,0 +1,108 @@
+#pragma once
+
+#include "chip8.h"
+
+// binary execution trace, one record per instruction (or every Nth with sampling) to compare
+// runs against each other or against other emulators writing the same format
+// while a trace is attached Run goes one Cycle at a time through the logged instructions so
+// the idle loop skip and fused sequences can't hide them, and at full speed through the ones
+// sampling leaves out, the machine ends up exactly where an untraced run would
+//
+// everything little endian, a file is a 16 byte header then blocks until the end:
+//   header  "C8TRACE" 1, uint32 every (1 logs every instruction), uint32 BLOCK_RECORDS
+//   block   uint32 bytes of records, uint32 records, uint64 instruction number of the first
+//           record (counting from 0 at Open), then the records, every block but the last
+//           holds exactly BLOCK_RECORDS so the same run always gives the same bytes
+//   record  uint8 flags, uint16 PC, uint16 opcode, uint16 I, all as they are after it ran
+//           except PC, which is the instruction's own address, then by flags:
+//           REGISTERS  uint16 mask of V registers that changed, bit X for VX, their new values
+//           WRITES     uint8 count, per run of written bytes uint16 address, uint8 length, bytes
+//           TIMERS     uint8 delay, uint8 sound
+// registers and timers are compared with the last record, the first record of a file has
+// all of them, with sampling memory writes are only those of the sampled instructions
+struct Chip8TraceRecord
+{
+    enum Flags
+    {
+        REGISTERS = 1,
+        WRITES = 2,
+        TIMERS = 4,
+    };
+
+    struct Write
+    {
+        uint16_t address;
+        uint8_t length;
+        const uint8_t *bytes; // into the record
+    };
+
+    uint8_t flags;
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t indexRegister;
+    uint16_t changed;       // REGISTERS mask
+    uint8_t registers[16];  // the changed ones are filled in
+    uint8_t delayTimer;
+    uint8_t soundTimer;
+    std::vector<Write> writes;
+
+    size_t Read(const uint8_t *in, size_t available); // bytes the record takes, 0 if it is cut short or broken
+    std::string Describe() const;                      // one line, "200 6A05 I=000 VA=05" and so on
+};
+
+class Chip8Trace
+{
+public:
+    static const uint32_t BLOCK_RECORDS = 65536;
+    static const size_t HEADER_SIZE = 16;
+    static const size_t BLOCK_HEADER_SIZE = 16;
+
+    Chip8Trace();
+    ~Chip8Trace();
+
+    bool Open(const char *path, uint32_t every = 1);
+    void Attach(Chip8 &chip8); // Cycle and Run on this Chip8 log to the file from now on
+    bool Close();              // writes the last block, false if anything failed to write
+
+    uint64_t Records() const; // written so far
+    uint64_t Bytes() const;
+
+    // Chip8::Cycle's side
+    bool Sample();                           // counts one instruction, true if it is to be logged
+    uint32_t Gap() const;                    // instructions before the next one to be logged
+    void Skip(uint32_t count);               // that many ran without Sample, no more than Gap
+    void Before(const Chip8 &chip8);         // the sampled instruction is about to run
+    void Wrote(uint16_t address, int length); // it wrote to memory, may come more than once
+    void After(const Chip8 &chip8);          // it ran, log it
+
+private:
+    static const int MAX_WRITES = 4;
+
+    FILE *file;
+    bool ok;
+    uint32_t every;
+    uint32_t countdown;    // instructions left before the next sampled one
+    uint64_t instructions; // counted by Sample
+    uint64_t records;
+    uint64_t bytes;
+
+    bool active;  // between Before and After
+    bool started; // last holds the previous record's values
+    uint16_t pc;
+    uint8_t lastRegisters[16];
+    uint8_t lastDelay;
+    uint8_t lastSound;
+    struct
+    {
+        uint16_t address;
+        uint16_t length;
+    } writes[MAX_WRITES];
+    int writeCount;
+
+    std::vector<uint8_t> block; // records of the block being filled, header in front
+    size_t used;                // bytes of it in use
+    uint32_t blockRecords;
+    uint64_t blockFirst;
+
+    void Flush();
+};
@@ -0,0 +1,191 @@
+#include "trace.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// finds the first instruction where two traces disagree
+// both files are mapped and compared as raw bytes, up to the first differing byte the two
+// runs did exactly the same, so only the block holding that byte is parsed record by record
+// exits 0 if the traces are the same, 1 if they diverge, 2 if they can't be compared
+
+struct Mapped
+{
+    const uint8_t *data = NULL;
+    size_t size = 0;
+
+    bool Open(const char *path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)Chip8Trace::HEADER_SIZE)
+        {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping keeps the file
+        if (p == MAP_FAILED)
+            return false;
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = (const uint8_t *)p;
+        return memcmp(data, "C8TRACE\1", 8) == 0;
+    }
+
+    ~Mapped()
+    {
+        if (data != NULL)
+            munmap((void *)data, size);
+    }
+
+    uint32_t Get32(size_t at) const
+    {
+        return data[at] | (data[at + 1] << 8) | (data[at + 2] << 16) | ((uint32_t)data[at + 3] << 24);
+    }
+
+    // records of the block at pos, clipped to the file if it was cut short
+    vector<pair<size_t, size_t>> Records(size_t pos, uint64_t &first) const
+    {
+        vector<pair<size_t, size_t>> records; // offset, size
+        first = 0;
+        if (pos + Chip8Trace::BLOCK_HEADER_SIZE > size)
+            return records;
+        size_t end = min(size, pos + Chip8Trace::BLOCK_HEADER_SIZE + Get32(pos));
+        uint32_t count = Get32(pos + 4);
+        first = Get32(pos + 8) | (uint64_t)Get32(pos + 12) << 32;
+        size_t at = pos + Chip8Trace::BLOCK_HEADER_SIZE;
+        Chip8TraceRecord record;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            size_t length = record.Read(data + at, end - at);
+            if (length == 0)
+                break;
+            records.push_back(make_pair(at, length));
+            at += length;
+        }
+        return records;
+    }
+};
+
+static string Describe(const Mapped &file, pair<size_t, size_t> record)
+{
+    Chip8TraceRecord r;
+    r.Read(file.data + record.first, record.second);
+    return r.Describe();
+}
+
+int main(int argc, char **argv)
+{
+    // Command usage
+    if (argc < 3)
+    {
+        cout << "Usage: chip8-tracediff <trace A> <trace B> [-c context records]" << endl;
+        return 2;
+    }
+
+    int context = 3;
+    for (int i = 3; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 2;
+        }
+        if (strcmp(argv[i], "-c") == 0)
+            context = max(atoi(argv[++i]), 0);
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            return 2;
+        }
+    }
+
+    Mapped a, b;
+    if (!a.Open(argv[1]))
+    {
+        cout << "Could not read a trace from " << argv[1] << endl;
+        return 2;
+    }
+    if (!b.Open(argv[2]))
+    {
+        cout << "Could not read a trace from " << argv[2] << endl;
+        return 2;
+    }
+    if (memcmp(a.data, b.data, Chip8Trace::HEADER_SIZE) != 0)
+    {
+        printf("traces were made with different settings, every %u / %u records per block %u / %u\n",
+               a.Get32(8), b.Get32(8), a.Get32(12), b.Get32(12));
+        return 2;
+    }
+    uint32_t every = a.Get32(8);
+
+    // first differing byte, big memcmp steps first and bytes only in the step that differs
+    size_t common = min(a.size, b.size);
+    size_t diff = Chip8Trace::HEADER_SIZE;
+    const size_t STEP = 1 << 20;
+    while (diff < common)
+    {
+        size_t n = min(STEP, common - diff);
+        if (memcmp(a.data + diff, b.data + diff, n) != 0)
+        {
+            while (a.data[diff] == b.data[diff])
+                diff++;
+            break;
+        }
+        diff += n;
+    }
+
+    // blocks up to the difference are the same in both, walk A's to the one holding it
+    size_t pos = Chip8Trace::HEADER_SIZE;
+    uint64_t total = 0;
+    while (pos + Chip8Trace::BLOCK_HEADER_SIZE <= diff)
+    {
+        size_t next = pos + Chip8Trace::BLOCK_HEADER_SIZE + a.Get32(pos);
+        if (next > diff)
+            break;
+        total += a.Get32(pos + 4);
+        pos = next;
+    }
+
+    if (diff == common && a.size == b.size)
+    {
+        printf("same: %llu records\n", (unsigned long long)total);
+        return 0;
+    }
+
+    uint64_t firstA, firstB;
+    vector<pair<size_t, size_t>> ra = a.Records(pos, firstA);
+    vector<pair<size_t, size_t>> rb = b.Records(pos, firstB);
+    size_t k = 0;
+    while (k < ra.size() && k < rb.size() && ra[k].second == rb[k].second &&
+           memcmp(a.data + ra[k].first, b.data + rb[k].first, ra[k].second) == 0)
+        k++;
+
+    uint64_t first = ra.empty() ? firstB : firstA;
+    if (k == ra.size() && k == rb.size())
+    {
+        // every record matches, the blocks only differ in their headers
+        printf("records match but block at offset %zu differs, numbered from %llu / %llu\n", pos,
+               (unsigned long long)firstA, (unsigned long long)firstB);
+        return 1;
+    }
+
+    printf("diverge:  record %llu, instruction %llu, byte offset %zu\n", (unsigned long long)(total + k),
+           (unsigned long long)(first + k * every), diff);
+    for (size_t i = k > (size_t)context ? k - context : 0; i < k; i++)
+        printf("  both:   %s\n", Describe(a, ra[i]).c_str());
+    if (k < ra.size())
+        printf("  A:      %s\n", Describe(a, ra[k]).c_str());
+    else
+        printf("  A:      ends\n");
+    if (k < rb.size())
+        printf("  B:      %s\n", Describe(b, rb[k]).c_str());
+    else
+        printf("  B:      ends\n");
+    return 1;
+}
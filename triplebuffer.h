@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+
+// one producer, one consumer, neither ever waits for the other
+// the producer fills Back() and publishes it, the consumer takes the newest published
+// buffer with Update() and reads Front(), anything published in between is dropped
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : back(0), middle(1), front(2) {}
+
+    // producer side
+    T &Back() { return buffers[back]; }
+    void Publish() { back = middle.exchange(back | FRESH) & INDEX; }
+
+    // consumer side
+    bool Update() // true if something new was published since the last call
+    {
+        if (!(middle.load() & FRESH))
+            return false;
+        front = middle.exchange(front) & INDEX;
+        return true;
+    }
+    const T &Front() { return buffers[front]; }
+
+private:
+    static const int INDEX = 3; // buffer number
+    static const int FRESH = 4; // middle holds a buffer the consumer hasn't seen
+
+    T buffers[3];
+    alignas(64) int back;               // only the producer touches it
+    alignas(64) std::atomic<int> middle; // swapped by both
+    alignas(64) int front;              // only the consumer touches it
+};
@@ -0,0 +1,207 @@
+#include "capture.h"
+
+using namespace std;
+
+// turns a .c8v recording into something a person can watch
+// a Y4M stream (plays in ffplay / mpv, converts with ffmpeg) or one PNG per frame
+// both are grayscale at a fixed 128x64 times the scale, low-res frames are doubled up to fill it,
+// XO-CHIP planes use the frontend's colors: off black, plane 1 white, plane 2 light, both dark gray
+
+static const uint8_t SHADES[4] = {0x00, 0xFF, 0xAA, 0x55};
+
+// one byte per pixel, rows of 128 * scale
+static void Render(const Chip8CaptureFrame &frame, int scale, vector<uint8_t> &pixels)
+{
+    int width = 128 * scale;
+    pixels.resize(width * 64 * scale);
+    for (int y = 0; y < 64; y++)
+    {
+        int row = frame.hires ? y : y / 2;
+        for (int x = 0; x < 128; x++)
+        {
+            int column = frame.hires ? x : x / 2;
+            int half = column / 64, bit = 63 - column % 64;
+            int color = ((frame.video[0][row][half] >> bit) & 1) | (((frame.video[1][row][half] >> bit) & 1) << 1);
+            for (int i = 0; i < scale; i++)
+                memset(&pixels[(y * scale + i) * width + x * scale], SHADES[color], scale);
+        }
+    }
+}
+
+static uint32_t Crc(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static uint32_t table[256];
+    if (table[1] == 0)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void Put32(vector<uint8_t> &out, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(value >> shift);
+}
+
+static void Chunk(vector<uint8_t> &png, const char *type, const vector<uint8_t> &data)
+{
+    Put32(png, data.size());
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    Put32(png, Crc(0, &png[start], png.size() - start));
+}
+
+// 8-bit grayscale, the zlib stream uses stored blocks only so there is no compressor to carry around
+static bool WritePng(const char *path, const vector<uint8_t> &pixels, int width, int height)
+{
+    vector<uint8_t> raw;
+    for (int y = 0; y < height; y++)
+    {
+        raw.push_back(0); // no filter
+        raw.insert(raw.end(), pixels.begin() + y * width, pixels.begin() + (y + 1) * width);
+    }
+
+    vector<uint8_t> header;
+    Put32(header, width);
+    Put32(header, height);
+    header.insert(header.end(), {8, 0, 0, 0, 0}); // 8 bits, grayscale, deflate, no filter choice, no interlace
+
+    vector<uint8_t> zlib = {0x78, 0x01};
+    uint32_t a = 1, b = 0; // Adler-32
+    for (size_t at = 0; at < raw.size(); at += 0xFFFF)
+    {
+        size_t size = min(raw.size() - at, (size_t)0xFFFF);
+        zlib.push_back(at + size == raw.size());
+        zlib.insert(zlib.end(), {uint8_t(size), uint8_t(size >> 8), uint8_t(~size), uint8_t(~size >> 8)});
+        zlib.insert(zlib.end(), raw.begin() + at, raw.begin() + at + size);
+        for (size_t i = at; i < at + size; i++)
+        {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+    }
+    Put32(zlib, (b << 16) | a);
+
+    vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    Chunk(png, "IHDR", header);
+    Chunk(png, "IDAT", zlib);
+    Chunk(png, "IEND", {});
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+        return false;
+    bool ok = fwrite(png.data(), 1, png.size(), out) == png.size();
+    return (fclose(out) == 0) && ok;
+}
+
+int main(int argc, char **argv)
+{
+    // Command usage
+    if (argc < 2)
+    {
+        cout << "Usage: chip8-video <capture.c8v> [-y out.y4m] [-p PNG file prefix] [-s scale]" << endl;
+        return 1;
+    }
+
+    const char *y4mPath = NULL;
+    const char *pngPrefix = NULL;
+    int scale = 4;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "-y") == 0)
+            y4mPath = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0)
+            pngPrefix = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0)
+            scale = atoi(argv[++i]);
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    if (scale < 1 || scale > 16)
+    {
+        cout << "Scale must be 1 to 16" << endl;
+        return 1;
+    }
+
+    Chip8CaptureReader reader;
+    if (!reader.Open(argv[1]))
+    {
+        cout << "Could not read " << argv[1] << endl;
+        return 1;
+    }
+
+    int width = 128 * scale, height = 64 * scale;
+    FILE *y4m = NULL;
+    if (y4mPath != NULL)
+    {
+        y4m = fopen(y4mPath, "wb");
+        if (y4m == NULL)
+        {
+            cout << "Could not write " << y4mPath << endl;
+            return 1;
+        }
+        fprintf(y4m, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", width, height);
+    }
+    vector<uint8_t> chroma(width * height / 2, 0x80); // U and V, no color
+
+    Chip8CaptureFrame frame;
+    vector<uint8_t> pixels;
+    uint64_t frames = 0, hires = 0;
+    bool ok = true;
+    while (reader.Next(frame))
+    {
+        hires += frame.hires;
+        if (y4m != NULL || pngPrefix != NULL)
+            Render(frame, scale, pixels);
+        if (y4m != NULL)
+        {
+            fputs("FRAME\n", y4m);
+            ok &= fwrite(pixels.data(), 1, pixels.size(), y4m) == pixels.size();
+            ok &= fwrite(chroma.data(), 1, chroma.size(), y4m) == chroma.size();
+        }
+        if (pngPrefix != NULL)
+        {
+            string path = pngPrefix + to_string(1000000 + frames).substr(1) + ".png";
+            if (!WritePng(path.c_str(), pixels, width, height))
+            {
+                cout << "Could not write " << path << endl;
+                return 1;
+            }
+        }
+        frames++;
+    }
+
+    if (y4m != NULL && (fclose(y4m) != 0 || !ok))
+    {
+        cout << "Could not write " << y4mPath << endl;
+        return 1;
+    }
+    printf("frames:   %llu (%llu hi-res)\n", (unsigned long long)frames, (unsigned long long)hires);
+    if (reader.Broken())
+    {
+        cout << "Damaged record after frame " << frames << ", stopped there" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,266 @@
+#include "capture.h"
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+using namespace std;
+
+// viewer for chip8-serve, mostly for testing it: opens one or more connections to the same
+// machine, rebuilds the screen from the updates, can hold a key down, and reports what it got
+// exits 0 once every connection has had its updates, 1 if anything went wrong
+
+struct Connection
+{
+    int fd = -1;
+    vector<uint8_t> in; // received and not parsed yet
+    bool greeted = false;
+    bool open = true;
+    Chip8CaptureFrame frame = {};
+    uint64_t updates = 0;
+    uint64_t bytes = 0;
+};
+
+static int Connect(const char *where)
+{
+    // all digits is a TCP port on 127.0.0.1, anything else a socket path
+    bool port = strspn(where, "0123456789") == strlen(where);
+    int fd = socket(port ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int result;
+    if (port)
+    {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(atoi(where));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        result = connect(fd, (sockaddr *)&address, sizeof(address));
+    }
+    else
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, where, sizeof(address.sun_path) - 1);
+        result = connect(fd, (sockaddr *)&address, sizeof(address));
+    }
+    if (result != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool Send(int fd, uint8_t type, uint8_t value)
+{
+    uint8_t message[2] = {type, value};
+    return send(fd, message, 2, MSG_NOSIGNAL) == 2;
+}
+
+// whole records out of the received bytes, false if they don't make sense
+static bool Parse(Connection &c)
+{
+    size_t at = 0;
+    if (!c.greeted)
+    {
+        if (c.in.size() < 4)
+            return true;
+        if (memcmp(c.in.data(), "C8V\1", 4) != 0)
+            return false;
+        c.greeted = true;
+        at = 4;
+    }
+    for (;;)
+    {
+        // [flags][varint length][payload]
+        size_t p = at + 1, length = 0;
+        int shift = 0;
+        for (; p < c.in.size() && shift < 32; p++, shift += 7)
+        {
+            length |= (size_t)(c.in[p] & 0x7F) << shift;
+            if (!(c.in[p] & 0x80))
+                break;
+        }
+        if (shift >= 32)
+            return false;
+        if (p >= c.in.size() || c.in.size() - p - 1 < length)
+            break; // not all here yet
+        if (!Chip8CaptureReader::Apply(c.frame, c.in[at], &c.in[p + 1], length))
+            return false;
+        c.updates++;
+        at = p + 1 + length;
+    }
+    c.in.erase(c.in.begin(), c.in.begin() + at);
+    return true;
+}
+
+static uint64_t Hash(const Chip8CaptureFrame &frame)
+{
+    // FNV-1a over the screen
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const uint8_t *bytes = (const uint8_t *)frame.video;
+    for (size_t i = 0; i < sizeof(frame.video); i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    return hash ^ frame.hires;
+}
+
+int main(int argc, char **argv)
+{
+    // Command usage
+    if (argc < 2)
+    {
+        cout << "Usage: chip8-watch <socket path | TCP port> [-m machine] [-n updates per connection, 0 until the server closes] [-c connections] [-k key to hold] [-o stream.c8v] [-p]" << endl;
+        return 1;
+    }
+
+    int machine = 0;
+    uint64_t wanted = 1;
+    int count = 1;
+    int key = -1;
+    const char *outPath = NULL; // first connection's stream as it came in, a capture file
+    bool print = false;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            print = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "-m") == 0)
+            machine = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0)
+            wanted = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-c") == 0)
+            count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0)
+            key = strtol(argv[++i], NULL, 16);
+        else if (strcmp(argv[i], "-o") == 0)
+            outPath = argv[++i];
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    if (machine < 0 || machine > 255 || count < 1 || key > 15)
+    {
+        cout << "Machine is 0 to 255, connections at least 1 and keys 0 to F" << endl;
+        return 1;
+    }
+
+    FILE *out = NULL;
+    if (outPath != NULL && (out = fopen(outPath, "wb")) == NULL)
+    {
+        cout << "Could not write " << outPath << endl;
+        return 1;
+    }
+
+    vector<Connection> connections(count);
+    for (int i = 0; i < count; i++)
+    {
+        connections[i].fd = Connect(argv[1]);
+        if (connections[i].fd < 0 || !Send(connections[i].fd, 'S', machine))
+        {
+            cout << "Could not connect to " << argv[1] << endl;
+            return 1;
+        }
+    }
+    if (key >= 0)
+        Send(connections[0].fd, 'D', key);
+
+    auto start = chrono::steady_clock::now();
+    bool ok = true;
+    for (;;)
+    {
+        // everyone done or gone
+        vector<pollfd> fds;
+        vector<int> which;
+        for (int i = 0; i < count; i++)
+        {
+            Connection &c = connections[i];
+            if (c.open && (wanted == 0 || c.updates < wanted))
+            {
+                fds.push_back({c.fd, POLLIN, 0});
+                which.push_back(i);
+            }
+        }
+        if (fds.empty())
+            break;
+
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+            break;
+        for (size_t f = 0; f < fds.size(); f++)
+        {
+            if (fds[f].revents == 0)
+                continue;
+            Connection &c = connections[which[f]];
+            uint8_t buffer[65536];
+            ssize_t got = recv(c.fd, buffer, sizeof(buffer), 0);
+            if (got <= 0)
+            {
+                c.open = false; // server went away
+                continue;
+            }
+            c.bytes += got;
+            if (out != NULL && which[f] == 0)
+                fwrite(buffer, 1, got, out);
+            c.in.insert(c.in.end(), buffer, buffer + got);
+            if (!Parse(c))
+            {
+                cout << "Bad stream on connection " << which[f] << endl;
+                c.open = false;
+                ok = false;
+            }
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (key >= 0 && connections[0].open)
+        Send(connections[0].fd, 'U', key);
+
+    uint64_t least = UINT64_MAX, most = 0, bytes = 0;
+    for (int i = 0; i < count; i++)
+    {
+        least = min(least, connections[i].updates);
+        most = max(most, connections[i].updates);
+        bytes += connections[i].bytes;
+        close(connections[i].fd);
+    }
+    if (wanted != 0 && least < wanted)
+        ok = false; // closed early
+
+    const Chip8CaptureFrame &frame = connections[0].frame;
+    printf("viewers:  %d on machine %d\n", count, machine);
+    printf("updates:  %llu to %llu per connection, %llu bytes in %.3f s\n", (unsigned long long)least,
+           (unsigned long long)most, (unsigned long long)bytes, seconds);
+    printf("screen:   %016llx%s\n", (unsigned long long)Hash(frame), frame.hires ? " hi-res" : "");
+    if (print)
+    {
+        int width = frame.hires ? 128 : 64, height = frame.hires ? 64 : 32;
+        for (int y = 0; y < height; y++)
+        {
+            string line;
+            for (int x = 0; x < width; x++)
+            {
+                int bit = 63 - x % 64;
+                int color = ((frame.video[0][y][x / 64] >> bit) & 1) | (((frame.video[1][y][x / 64] >> bit) & 1) << 1);
+                line += " #+*"[color];
+            }
+            printf("%s\n", line.c_str());
+        }
+    }
+    if (out != NULL && fclose(out) != 0)
+        ok = false;
+    return ok ? 0 : 1;
+}